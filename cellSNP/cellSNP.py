@@ -13,9 +13,21 @@ import multiprocessing
 from optparse import OptionParser, OptionGroup
 
 from .version import __version__
-from .utils.pileup_utils import fetch_positions
-from .utils.pileup_regions import pileup_regions
+from .utils.pileup_utils import fetch_positions, check_pysam_chrom
+from .utils.pileup_utils import get_read_groups, get_contig_map
+from .utils.pileup_utils import set_cram_options, init_cram_options
+from .utils.pileup_regions import pileup_regions, load_bed_regions
+from .utils.stream_utils import stream_positions, stream_regions
 from .utils.vcf_utils import load_VCF, merge_vcf, VCF_to_sparseMat
+from .utils.schedule_utils import parse_mem, plan_workers, split_sites
+from .utils.schedule_utils import split_regions
+from .utils.schedule_utils import init_mem_guard, HOT_DEPTH
+from .utils.stats_utils import run_with_stats, write_stats, merge_stats
+from .utils.stats_utils import reject_summary
+from .utils.stats_utils import new_progress, init_progress, monitor_progress
+from .utils.sweep_utils import ENGINES, merge_engine_logs
+from .utils.raw_utils import merge_raw, refilter_raw
+from .utils.feature_utils import FeatureIndex, FeatureCounter, merge_features
 
 DEF_FLAG_WITH_UMI = 4096       # default value of max_FLAG when using UMIs, i.e., UMI_tag is not None
 DEF_FLAG_WITHOUT_UMI = 255     # default value of max_FLAG when not using UMIs, i.e., UMI_tag is None
@@ -25,17 +37,364 @@ START_TIME = time.time()
 def show_progress(RV=None):
     return RV
 
+def init_worker(hot_sem, hot_depth, progress_block, slot_counter,
+                cram_options=(None, None)):
+    """Initialize each subprocess with the memory guard, a progress slot and
+    the options of opening cram files.
+    """
+    init_mem_guard(hot_sem, hot_depth)
+    init_progress(progress_block, slot_counter)
+    init_cram_options(cram_options)
+
+def get_tags(options, barcodes):
+    """Cell tag, UMI tag and max_FLAG from the options.
+    """
+    if options.sample_tag is not None:
+        cell_tag = options.sample_tag
+    elif options.cell_tag.upper() == "NONE" or barcodes is None:
+        cell_tag = None
+    else:
+        cell_tag = options.cell_tag
+    if options.UMI_tag.upper() == "AUTO":
+        if barcodes is None or options.sample_tag is not None:
+            UMI_tag = None
+        else:
+            UMI_tag = "UR"
+    elif options.UMI_tag.upper() == "NONE":
+        UMI_tag = None
+    else:
+        UMI_tag = options.UMI_tag
+    max_FLAG = options.max_FLAG
+    if options.max_FLAG is None:
+        max_FLAG = DEF_FLAG_WITHOUT_UMI if UMI_tag is None else DEF_FLAG_WITH_UMI
+    return cell_tag, UMI_tag, max_FLAG
+
+def load_groups(group_file, barcodes=None):
+    """Load the groups of cells, e.g., clusters or donors, one cell per line
+    with tab separated barcode and group; the cells are kept to barcodes if 
+    given. Return the sorted barcodes of the groups, and (sorted group names,
+    group index of each barcode) for map_barcodes.
+    """
+    cell_group = {}
+    fid = open(group_file, "r")
+    for line in fid:
+        if line.startswith("#") or line.strip() == "":
+            continue
+        _val = line.rstrip("\n").split("\t")
+        if len(_val) < 2:
+            print("Error: need barcode and group in each line of groupFile."
+                  "\n    -- %s" %line.rstrip())
+            sys.exit(1)
+        if cell_group.get(_val[0], _val[1]) != _val[1]:
+            print("Error: barcode %s in two groups %s and %s of groupFile." 
+                  %(_val[0], cell_group[_val[0]], _val[1]))
+            sys.exit(1)
+        cell_group[_val[0]] = _val[1]
+    fid.close()
+    if barcodes is not None:
+        cell_group = dict([(x, cell_group[x]) for x in barcodes 
+                           if x in cell_group])
+    if len(cell_group) == 0:
+        print("Error: no cells of groupFile in the barcodes.")
+        sys.exit(1)
+    barcodes = sorted(cell_group.keys())
+    group_names = sorted(set(cell_group.values()))
+    group_idx = dict([(group_names[k], k) for k in range(len(group_names))])
+    return barcodes, (group_names, [group_idx[cell_group[x]] for x in barcodes])
+
+## SNP panel shared by the subprocesses in batch mode
+BATCH_PANEL = None
+
+def init_batch_worker(panel, *worker_args):
+    """Initialize each subprocess of batch mode with the shared panel.
+    """
+    global BATCH_PANEL
+    BATCH_PANEL = panel
+    init_worker(*worker_args)
+
+def fetch_panel_chunk(start, end, sam_files, barcodes, out_file, fetch_args,
+                      verbose, worker_mem, engine, engine_log, io_threads, 
+                      no_GL=False, raw_prefix=None, groups=None, 
+                      features=None):
+    """Run fetch_positions for the SNPs [start, end) of the shared panel.
+    """
+    chrom_list, pos_list, REF_list, ALT_list = BATCH_PANEL
+    return fetch_positions(sam_files, chrom_list[start : end], 
+        pos_list[start : end], REF_list[start : end], ALT_list[start : end], 
+        barcodes, None, out_file, *fetch_args, verbose, worker_mem, engine, 
+        engine_log, io_threads, no_GL=no_GL, raw_prefix=raw_prefix, 
+        groups=groups, features=features)
+
+def get_raw_prefix(out_file_tmp, save_raw):
+    """Prefix of the raw count chunks of a job, None without saveRAW.
+    """
+    return out_file_tmp + "raw" if save_raw else None
+
+def save_raw_chunks(out_file, out_files):
+    """Collect the raw count chunks of all jobs into cellSNP.raw next to the
+    output VCF, before merge_vcf removes the temp files.
+    """
+    raw_dir = os.path.join(os.path.dirname(out_file), "cellSNP.raw")
+    n_chunk = merge_raw(raw_dir, [get_raw_prefix(x, True) for x in out_files],
+                        out_files[0])
+    print("[cellSNP] raw counts saved in %d chunks in %s" %(n_chunk, raw_dir))
+
+def load_features(feature_file):
+    """Interval index of the features in featureBED, None if not given.
+    """
+    if feature_file is None:
+        return None
+    if os.path.isfile(feature_file) == False:
+        print("Error: No such file\n    -- %s" %feature_file)
+        sys.exit(1)
+    try:
+        feature_index = FeatureIndex(feature_file)
+    except ValueError as e:
+        print("[cellSNP] Error: %s" %e)
+        sys.exit(1)
+    print("[cellSNP] %d features in %s" %(len(feature_index), feature_file))
+    return feature_index
+
+def get_feature_counter(out_file_tmp, feature_index):
+    """Feature counts of a job, None without featureBED.
+    """
+    if feature_index is None:
+        return None
+    return FeatureCounter(feature_index, out_file_tmp + "feature.npz")
+
+def save_feature_counts(out_file, out_files, feature_index):
+    """Sum the feature counts of all jobs into the feature matrices next to 
+    the output VCF, before merge_vcf removes the temp files.
+    """
+    out_dir = os.path.dirname(out_file)
+    n_used = merge_features(out_dir, feature_index, 
+        [x + "feature.npz" for x in out_files], out_files[0])
+    print("[cellSNP] %d features with SNPs, matrices saved in %s" 
+          %(n_used, out_dir))
+
+def load_batch(batch_file):
+    """Load the libraries of batch mode, one per line with tab separated 
+    sam file(s) (comma separated), barcode file and output directory.
+    """
+    libs = []
+    fid = open(batch_file, "r")
+    for line in fid:
+        if line.startswith("#") or line.strip() == "":
+            continue
+        _val = line.rstrip("\n").split("\t")
+        if len(_val) < 3:
+            print("Error: need sam file(s), barcode file and outDir in each "
+                  "line of batchFile.\n    -- %s" %line.rstrip())
+            sys.exit(1)
+        libs.append({"sam_files": _val[0].split(","), "barcode_file": _val[1], 
+                     "out_dir": _val[2]})
+    fid.close()
+    for lib in libs:
+        for _file in lib["sam_files"] + [lib["barcode_file"]]:
+            if os.path.isfile(_file) == False:
+                print("Error: No such file\n    -- %s" %_file)
+                sys.exit(1)
+    return libs
+
+def run_batch(options):
+    """Batch mode: fetch one SNP panel in many single-cell libraries listed 
+    in batchFile. The panel is loaded once and shared by the subprocesses, 
+    and the SNP chunks of all libraries are run on one pool.
+    """
+    global BATCH_PANEL
+    if options.region_file is None or os.path.isfile(options.region_file) == False:
+        print("Error: batchFile needs regionsVCF.")
+        sys.exit(1)
+    if options.engine not in ENGINES:
+        print("Error: engine should be one of %s." %", ".join(ENGINES))
+        sys.exit(1)
+    if (options.group_file is not None and 
+        os.path.isfile(options.group_file) == False):
+        print("Error: No such file\n    -- %s" %options.group_file)
+        sys.exit(1)
+    libs = load_batch(options.batch_file)
+    for lib in libs:
+        lib["barcodes"] = sorted(list(np.genfromtxt(lib["barcode_file"], 
+                                                    dtype="str", delimiter="\t")))
+        lib["groups"] = None
+        if options.group_file is not None:
+            lib["barcodes"], lib["groups"] = load_groups(options.group_file, 
+                                                         lib["barcodes"])
+        if not os.path.exists(lib["out_dir"]):
+            os.makedirs(lib["out_dir"])
+        lib["out_file"] = os.path.join(lib["out_dir"], "cellSNP.cells.vcf.gz")
+        lib["out_files"], lib["engine_logs"], lib["result"] = [], [], []
+    print("[cellSNP] batch mode: fetch given SNPs in %d libraries." %len(libs))
+
+    print("[cellSNP] loading the VCF file for given SNPs ...")
+    vcf_RV = load_VCF(options.region_file, biallelic_only=True, 
+                      load_sample=False)['FixedINFO']
+    BATCH_PANEL = (vcf_RV["CHROM"], vcf_RV["POS"], vcf_RV["REF"], vcf_RV["ALT"])
+    n_sites = len(vcf_RV["POS"])
+    print("[cellSNP] fetching %d candidate variants ..." %n_sites)
+
+    feature_index = load_features(options.feature_file)
+
+    cell_tag, UMI_tag, max_FLAG = get_tags(options, libs[0]["barcodes"])
+    cram_options = set_cram_options(options.ref_file, [cell_tag, UMI_tag], 
+                                    quals = not options.no_GL)
+    fetch_args = (cell_tag, UMI_tag, options.min_COUNT, options.min_MAF, 
+                  options.min_MAPQ, max_FLAG, options.min_LEN, options.doubletGL)
+    try:
+        max_mem = parse_mem(options.max_mem)
+    except ValueError:
+        print("Error: invalid maxMEM %s" %options.max_mem)
+        sys.exit(1)
+    n_cells = max([len(x["barcodes"]) for x in libs])
+    nproc, n_hot, worker_mem = plan_workers(options.nproc, max_mem, n_cells)
+    timing = options.stats_json is not None
+    if nproc > 1:
+        hot_sem = None if max_mem is None else multiprocessing.Semaphore(n_hot)
+        progress_block, slot_counter = new_progress(nproc)
+        pool = multiprocessing.Pool(processes=nproc, 
+            initializer=init_batch_worker, initargs=(BATCH_PANEL, hot_sem, 
+            HOT_DEPTH, progress_block, slot_counter, cram_options))
+
+    # chunks of all libraries are queued on the same pool
+    for lib in libs:
+        io_threads = options.io_threads
+        if io_threads is None:
+            io_threads = 1 if len(lib["sam_files"]) > 1 else 0
+        if nproc > 1:
+            batches = split_sites(n_sites, nproc, worker_mem, 
+                                  len(lib["barcodes"]))
+        else:
+            batches = [(0, n_sites)]
+        for ii in range(len(batches)):
+            out_file_tmp = lib["out_file"] + ".temp_%d_" %(ii)
+            lib["out_files"].append(out_file_tmp)
+            lib["engine_logs"].append(out_file_tmp + "engine")
+            job_args = (batches[ii][0], batches[ii][1], lib["sam_files"], 
+                lib["barcodes"], out_file_tmp, fetch_args, nproc == 1, 
+                worker_mem, options.engine, lib["engine_logs"][-1], io_threads, 
+                options.no_GL, get_raw_prefix(out_file_tmp, options.save_raw),
+                lib["groups"], get_feature_counter(out_file_tmp, feature_index))
+            if nproc > 1:
+                lib["result"].append(pool.apply_async(run_with_stats, 
+                    (fetch_panel_chunk, job_args, timing), 
+                    callback=show_progress))
+            else:
+                lib["result"].append(run_with_stats(fetch_panel_chunk, 
+                    job_args, timing))
+    if nproc > 1:
+        pool.close()
+        monitor_progress(sum([x["result"] for x in libs], []), progress_block,
+                         n_sites * len(libs))
+        pool.join()
+        print("")
+
+    run_time = time.time() - START_TIME
+    for lib in libs:
+        print("[cellSNP] merging temp files for %s ..." %lib["out_dir"])
+        result = [res.get() if nproc > 1 else res for res in lib["result"]]
+        if options.save_raw:
+            save_raw_chunks(lib["out_file"], lib["out_files"])
+        if feature_index is not None:
+            save_feature_counts(lib["out_file"], lib["out_files"], 
+                                feature_index)
+        merge_vcf(lib["out_file"], lib["out_files"], options.save_HDF5)
+        VCF_to_sparseMat(lib["out_file"], tags=["AD", "DP", "OTH"], 
+            out_dir=lib["out_dir"])
+        if options.engine != "fetch":
+            merge_engine_logs(os.path.join(lib["out_dir"], 
+                "cellSNP.engine.tsv"), lib["engine_logs"])
+        run_stats = merge_stats([res[1] for res in result])
+        print(reject_summary(run_stats))
+        if options.stats_json is not None:
+            write_stats(os.path.join(lib["out_dir"], 
+                os.path.basename(options.stats_json)), run_stats, run_time, 
+                info={"version": __version__, "nproc": nproc, "argv": sys.argv,
+                      "sam_files": lib["sam_files"]})
+
+    run_time = time.time() - START_TIME
+    print("[cellSNP] All done: %d min %.1f sec" %(int(run_time / 60), 
+                                                  run_time % 60))
+
+def run_refilter(argv):
+    """`cellSNP refilter`: re-apply the thresholds, REF/ALT choice and 
+    genotyping to the raw counts saved by --saveRAW, without the sam files.
+    """
+    parser = OptionParser(usage="cellSNP refilter -i RAW_DIR -O OUT_DIR "
+                          "[options]")
+    parser.add_option("--rawDir", "-i", dest="raw_dir", default=None,
+        help="The cellSNP.raw directory saved by --saveRAW.")
+    parser.add_option("--outDir", "-O", dest="sparse_dir", default=None,
+        help="Output directory for VCF and sparse matrices.")
+    parser.add_option("--outVCF", "-o", dest="out_file", default=None,
+        help="Output full path file name for VCF file.")
+    parser.add_option("--minCOUNT", type="int", dest="min_COUNT", default=20, 
+        help="Minimum aggragated count, not below the one of the pileup "
+        "[default: %default]")
+    parser.add_option("--minMAF", type="float", dest="min_MAF", default=0.0, 
+        help="Minimum minor allele frequency [default: %default]")
+    parser.add_option("--doubletGL", dest="doubletGL", action="store_true", 
+        default=False, 
+        help="If use, keep doublet GT likelihood, i.e., GT=0.5 and GT=1.5")
+    parser.add_option("--noGL", dest="no_GL", action="store_true", 
+        default=False, help="If use, skip GT and PL and only output "
+        "AD:DP:OTH:ALL.")
+    parser.add_option("--countREF", dest="count_REF", action="store_true", 
+        default=False, help="If use, choose REF and ALT by the counts, even "
+        "if regionsVCF of the pileup gave them.")
+    parser.add_option("--saveHDF5", dest="save_HDF5", action="store_true", 
+        default=False, help="If use, save an output file in HDF5 format.")
+
+    (options, args) = parser.parse_args(argv)
+    if options.raw_dir is None or os.path.isdir(options.raw_dir) == False:
+        print("Error: need rawDir for the raw counts saved by --saveRAW.")
+        sys.exit(1)
+    if options.no_GL and options.doubletGL:
+        print("Error: doubletGL can't be used with noGL.")
+        sys.exit(1)
+    if options.sparse_dir is not None:
+        if not os.path.exists(options.sparse_dir):
+            os.mkdir(options.sparse_dir)
+        out_file = os.path.join(options.sparse_dir, "cellSNP.cells.vcf.gz")
+    elif options.out_file is None:
+        print("Error: need outDir or outVCF for the output.")
+        sys.exit(1)
+    else:
+        out_file = options.out_file
+    
+    print("[cellSNP] refiltering the raw counts in %s ..." %options.raw_dir)
+    out_file_tmp = out_file + ".temp_0_"
+    try:
+        refilter_raw(options.raw_dir, out_file_tmp, 
+            options.min_COUNT, options.min_MAF, options.doubletGL, 
+            options.no_GL, options.count_REF)
+    except ValueError as e:
+        print("[cellSNP] Error: %s" %e)
+        sys.exit(1)
+    merge_vcf(out_file, [out_file_tmp], options.save_HDF5)
+    if options.sparse_dir is not None:
+        VCF_to_sparseMat(out_file, tags=["AD", "DP", "OTH"], 
+            out_dir=options.sparse_dir)
+    run_time = time.time() - START_TIME
+    print("[cellSNP] All done: %d min %.1f sec" %(int(run_time / 60), 
+                                                  run_time % 60))
+
 def main():
     # import warnings
     # warnings.filterwarnings('error')
+    if len(sys.argv) > 1 and sys.argv[1] == "refilter":
+        run_refilter(sys.argv[2:])
+        return
 
     # parse command line options
     parser = OptionParser()
     parser.add_option("--samFile", "-s", dest="sam_file", default=None,
-        help=("Indexed sam/bam file(s), comma separated multiple samples. "
-              "Mode 1&2: one sam/bam file with single cell barcode; "
+        help=("Indexed sam/bam file(s), comma separated multiple samples, or "
+              "- for a coordinate-sorted stream on stdin (no index needed). "
+              "Mode 1&2: one or multiple sam/bam files with single cell "
+              "barcodes, e.g., lanes or libraries of one sample; "
               "Mode 3: one or multiple bulk sam/bam files, no barcodes needed, "
-              "but sample ids and regionsVCF."))
+              "but sample ids and regionsVCF; without regionsVCF, the bulk "
+              "files are piled up together as mode 2."))
     parser.add_option("--samFileList", "-S", dest="sam_file_list", default=None,
         help=("A list file containing bam files, each per line, for Mode 3."))
     parser.add_option("--outDir", "-O", dest="sparse_dir", default=None,
@@ -47,19 +406,50 @@ def main():
     parser.add_option("--regionsVCF", "-R", dest="region_file", default=None,
         help=("A vcf file listing all candidate SNPs, for fetch each variants. "
               "If None, pileup the genome. Needed for bulk samples."))
+    parser.add_option("--regionsBED", dest="region_bed", default=None,
+        help=("A BED file of regions, e.g., exons or amplicons, to pile up "
+              "rather than whole chromosomes in mode 2."))
     parser.add_option("--barcodeFile", "-b", dest="barcode_file", default=None,
         help=("A plain file listing all effective cell barcode."))
+    parser.add_option("--groupFile", dest="group_file", default=None,
+        help=("A tab separated file of cell barcode and group, e.g., cluster "
+              "or donor, to output the counts summed over the cells of each "
+              "group rather than each cell; barcodeFile is optional."))
     parser.add_option("--sampleIDs", "-I", dest="sample_ids", default=None,
         help=("Comma separated sample ids. Only use it when you input multiple "
               "bulk sam files."))
     
+    parser.add_option("--batchFile", dest="batch_file", default=None,
+        help=("A tab separated file of many single-cell libraries, each line "
+              "with sam file(s), barcode file and output directory, which are "
+              "fetched with the same regionsVCF in one run."))
+    
     group1 = OptionGroup(parser, "Optional arguments")
     group1.add_option("--nproc", "-p", type="int", dest="nproc", default=1,
         help="Number of subprocesses [default: %default]")
     group1.add_option("--chrom", dest="chrom_all", default=None, 
-        help="The chromosomes to use, comma separated [default: 1 to 22]")
+        help="The chromosomes to use, comma separated [default: all contigs "
+        "in the header of the (first) sam file, see chromPATTERN and "
+        "chromMinLEN]")
+    group1.add_option("--chromPATTERN", dest="chrom_pattern", default=None, 
+        help="Regular expression of the contigs to use in mode 2 without "
+        "chrom, e.g., 'chr[0-9XY]+' [default: all]")
+    group1.add_option("--chromMinLEN", type="int", dest="chrom_min_len", 
+        default=0, help="Minimum length of the contigs to use in mode 2 "
+        "without chrom, e.g., 1000000 to skip unplaced and alt contigs "
+        "[default: %default]")
     group1.add_option("--cellTAG", dest="cell_tag", default="CB", 
         help="Tag for cell barcodes, turn off with None [default: %default]")
+    group1.add_option("--barcodePREFIX", dest="barcode_prefix", default=None, 
+        help="Comma separated prefix added to the cell barcodes of each sam "
+        "file in mode 1&2, matching barcodeFile [default: None]")
+    group1.add_option("--barcodeSUFFIX", dest="barcode_suffix", default=None, 
+        help="Comma separated suffix added to the cell barcodes of each sam "
+        "file in mode 1&2, e.g., -1,-2 [default: None]")
+    group1.add_option("--sampleTAG", dest="sample_tag", default=None, 
+        help="Tag for samples in merged sam file(s), e.g., RG. Counts are "
+        "given for each sample id in sampleIDs, or each read group in the "
+        "header for RG, like cell barcodes [default: None]")
     group1.add_option("--UMItag", dest="UMI_tag", default="Auto", 
         help="Tag for UMI: UR, Auto, None. For Auto mode, use UR if barcodes "
         "is inputted, otherwise use None. None mode means no UMI but read "
@@ -72,8 +462,39 @@ def main():
     group1.add_option("--doubletGL", dest="doubletGL", action="store_true", 
         default=False, 
         help="If use, keep doublet GT likelihood, i.e., GT=0.5 and GT=1.5")
+    group1.add_option("--noGL", dest="no_GL", action="store_true", 
+        default=False, help="If use, skip GT and PL and only output "
+        "AD:DP:OTH:ALL, without reading base qualities.")
     group1.add_option("--saveHDF5", dest="save_HDF5", action="store_true", 
         default=False, help="If use, save an output file in HDF5 format.")
+    group1.add_option("--saveRAW", dest="save_raw", action="store_true", 
+        default=False, help="If use, save the per-cell counts (and quality "
+        "sums) of the sites passing minCOUNT into cellSNP.raw next to the "
+        "output VCF, for re-filtering with `cellSNP refilter`.")
+    group1.add_option("--featureBED", dest="feature_file", default=None, 
+        help="A BED file of features, e.g., genes, with names in the 4th "
+        "column. If use, also sum AD and DP of the output SNPs over each "
+        "feature per cell, saved in cellSNP.feature.AD.mtx and "
+        "cellSNP.feature.DP.mtx next to the output VCF.")
+    group1.add_option("--statsJSON", dest="stats_json", default=None, 
+        help="If use, save per-stage timing and counters into this json file. "
+        "The read counts of mode 2 on stdin are not comparable with mode 2 on "
+        "an indexed file, see info.pileup in the file.")
+    group1.add_option("--maxMEM", dest="max_mem", default=None, 
+        help="Memory budget for all subprocesses, e.g., 16G. It limits the "
+        "subprocesses and deep sites processed at the same time, and the "
+        "size of SNP batches [default: no limit]")
+    group1.add_option("--engine", dest="engine", default="fetch", 
+        help="How to read the given SNPs in mode 1&3: fetch the reads of each "
+        "SNP, sweep the reads of nearby SNPs once, or auto to choose per "
+        "region by panel density and expected depth; the regions are saved "
+        "in cellSNP.engine.tsv [default: %default]")
+    group1.add_option("--ioTHREADS", type="int", dest="io_threads", 
+        default=None, help="Decompression threads of each sam file in each "
+        "subprocess [default: 1 for multiple sam files, otherwise 0]")
+    group1.add_option("--refFASTA", dest="ref_file", default=None, 
+        help="Reference fasta of cram files, indexed by samtools faidx "
+        "[default: from the cram header]")
     
     group2 = OptionGroup(parser, "Read filtering")
     group2.add_option("--minLEN", type="int", dest="min_LEN", default=30, 
@@ -91,6 +512,18 @@ def main():
         print("Welcome to cellSNP v%s!\n" %(__version__))
         print("use -h or --help for help on argument.")
         sys.exit(1)
+    if options.ref_file is not None and not os.path.isfile(options.ref_file):
+        print("Error: No such file\n    -- %s" %options.ref_file)
+        sys.exit(1)
+    if options.no_GL and options.doubletGL:
+        print("Error: doubletGL can't be used with noGL.")
+        sys.exit(1)
+    if options.region_bed is not None and options.region_file is not None:
+        print("Error: regionsBED can't be used with regionsVCF.")
+        sys.exit(1)
+    if options.batch_file is not None:
+        run_batch(options)
+        return
         
     if options.sam_file is None and options.sam_file_list is None:
         print("Error: need samFile for sam file.")
@@ -101,12 +534,56 @@ def main():
         fid = open(options.sam_file_list, "r")
         sam_file_list = [x.rstrip() for x in fid.readlines()]
         fid.close()
+    is_stream = "-" in sam_file_list
+    if is_stream and len(sam_file_list) > 1:
+        print("Error: stdin (-) can only be used as the only sam file.")
+        sys.exit(1)
+    if is_stream and options.sample_tag == "RG" and options.sample_ids is None:
+        print("Error: need sampleIDs for sampleTAG RG with stdin.")
+        sys.exit(1)
+    if is_stream and (options.barcode_prefix is not None or 
+                      options.barcode_suffix is not None):
+        print("Error: barcodePREFIX and barcodeSUFFIX can't be used with stdin.")
+        sys.exit(1)
+    if is_stream and options.region_bed is not None:
+        print("Error: regionsBED can't be used with stdin.")
+        sys.exit(1)
     for sam_file in sam_file_list:
+        if sam_file == "-":
+            continue
         if os.path.isfile(sam_file) == False:
             print("Error: No such file\n    -- %s" %sam_file)
             sys.exit(1)
         
-    if options.barcode_file is None:
+    if options.sample_tag is not None:
+        # samples in one merged file are counted as cells by their tag
+        if options.barcode_file is not None:
+            print("Error: sampleTAG can't be used with barcodeFile.")
+            sys.exit(1)
+        sample_ids = None
+        if options.sample_ids is not None:
+            if os.path.isfile(options.sample_ids):
+                fid = open(options.sample_ids, "r")
+                barcodes = [x.rstrip() for x in fid.readlines()]
+                fid.close()
+            else:
+                barcodes = options.sample_ids.split(",")
+        elif options.sample_tag == "RG":
+            barcodes = get_read_groups(sam_file_list)
+        else:
+            print("Error: need sampleIDs for sampleTAG %s." %options.sample_tag)
+            sys.exit(1)
+        if len(barcodes) == 0:
+            print("Error: no sample ids for sampleTAG %s." %options.sample_tag)
+            sys.exit(1)
+        barcodes = sorted(barcodes)
+        print("[cellSNP] %d samples by tag %s: %s" %(len(barcodes), 
+              options.sample_tag, ",".join(barcodes[:5]) + 
+              (",..." if len(barcodes) > 5 else "")))
+    elif options.barcode_file is None and options.group_file is not None:
+        # the cells of groupFile, loaded below
+        barcodes, sample_ids = None, None
+    elif options.barcode_file is None:
         barcodes = None
         if options.sample_ids is None:
             sample_ids = ["Sample_%d" %x for x in range(len(sam_file_list))]
@@ -132,6 +609,33 @@ def main():
                                       dtype="str", delimiter="\t"))
         barcodes = sorted(barcodes)
         
+    # cells summed into one column per group
+    groups = None
+    if options.group_file is not None:
+        if os.path.isfile(options.group_file) == False:
+            print("Error: No such file\n    -- %s" %options.group_file)
+            sys.exit(1)
+        barcodes, groups = load_groups(options.group_file, barcodes)
+        print("[cellSNP] %d cells in %d groups: %s" %(len(barcodes), 
+              len(groups[0]), ",".join(groups[0][:5]) + 
+              (",..." if len(groups[0]) > 5 else "")))
+
+    # barcodes of each sam file are marked by its (prefix, suffix)
+    barcode_affix = None
+    if options.barcode_prefix is not None or options.barcode_suffix is not None:
+        if barcodes is None:
+            print("Error: barcodePREFIX and barcodeSUFFIX need barcodes.")
+            sys.exit(1)
+        _affix = []
+        for _opt in [options.barcode_prefix, options.barcode_suffix]:
+            _affix.append([""] * len(sam_file_list) if _opt is None 
+                          else _opt.split(","))
+            if len(_affix[-1]) != len(sam_file_list):
+                print("[cellSNP] Error: %d barcode affixes, %d sam files, not "
+                      "equal." %(len(_affix[-1]), len(sam_file_list)))
+                sys.exit(1)
+        barcode_affix = list(zip(_affix[0], _affix[1]))
+        
     if options.sparse_dir is not None:
         if not os.path.exists(options.sparse_dir):
             os.mkdir(options.sparse_dir)
@@ -147,23 +651,59 @@ def main():
         print("Error: No such directory for file\n -- %s" %out_file)
         sys.exit(1)        
       
+    bed_regions = None
     if options.region_file is None or options.region_file == "None":
         region_file = None
-        if options.chrom_all is None:
-            chrom_all = [str(x) for x in range(1, 23)]
-        else:
+        # the contigs of the header, built once and shared by all chroms
+        contigs = (None if is_stream else 
+                   get_contig_map(check_pysam_chrom(sam_file_list[0])[0]))
+        if options.chrom_all is not None:
             chrom_all = options.chrom_all.split(",")
-        if barcodes is not None:
-            print("[cellSNP] mode 2: pileup %d whole chromosomes in %d single "
-                "cells." %(len(chrom_all), len(barcodes)))
+        elif is_stream:
+            chrom_all = None    # the contigs of the stream header
+        else:
+            chrom_all = contigs.select(options.chrom_pattern, 
+                                       options.chrom_min_len)
+        if chrom_all is None:
+            _target = "the contigs of the stream"
         else:
-            print("[cellSNP] mode 2: pileup %d whole chromosomes in one "
-                "bulk sample." %(len(chrom_all)))
+            _target = "%d whole chromosomes" %len(chrom_all)
+        if options.region_bed is not None:
+            # only the regions, of the chroms in --chrom if given
+            if os.path.isfile(options.region_bed) == False:
+                print("Error: No such file\n    -- %s" %options.region_bed)
+                sys.exit(1)
+            try:
+                bed_chroms, bed_regions = load_bed_regions(options.region_bed)
+            except ValueError as e:
+                print("[cellSNP] Error: %s" %e)
+                sys.exit(1)
+            if options.chrom_all is None:
+                chrom_all = bed_chroms
+            else:
+                chrom_all = [x for x in bed_chroms if x in chrom_all or 
+                             contigs.resolve(x) in chrom_all]
+            _target = "%d regions (%d bp) of %d chromosomes" %(
+                sum([len(bed_regions[x]) for x in chrom_all]), 
+                sum([x[1] - x[0] for _chrom in chrom_all 
+                     for x in bed_regions[_chrom]]), len(chrom_all))
+        if barcodes is not None and options.sample_tag is not None:
+            print("[cellSNP] mode 2: pileup %s in %d tagged samples." 
+                  %(_target, len(barcodes)))
+        elif barcodes is not None:
+            print("[cellSNP] mode 2: pileup %s in %d single cells." 
+                  %(_target, len(barcodes)))
+        else:
+            print("[cellSNP] mode 2: pileup %s in %d bulk samples." 
+                  %(_target, len(sam_file_list)))
     elif os.path.isfile(options.region_file) == False:
         print("Error: No such file\n    -- %s" %options.region_file)
         sys.exit(1)
     else:
-        if barcodes is not None:
+        if barcodes is not None and options.sample_tag is not None:
+            print("[cellSNP] mode 3: fetch given SNPs in %d tagged samples."
+                  %(len(barcodes)))
+        elif barcodes is not None:
             print("[cellSNP] mode 1: fetch given SNPs in %d single cells."
                   %(len(barcodes)))
         else:
@@ -179,52 +719,116 @@ def main():
         chrom_list = vcf_RV["CHROM"]
         print("[cellSNP] fetching %d candidate variants ..." %len(pos_list))
     
-    if options.cell_tag.upper() == "NONE" or barcodes is None:
-        cell_tag = None
-    else:
-        cell_tag = options.cell_tag
-    if options.UMI_tag.upper() == "AUTO":
-        if barcodes is None:
-            UMI_tag = None
-        else:
-            UMI_tag = "UR"
-    elif options.UMI_tag.upper() == "NONE":
-        UMI_tag = None
-    else:
-        UMI_tag = options.UMI_tag
+    if options.engine not in ENGINES:
+        print("Error: engine should be one of %s." %", ".join(ENGINES))
+        sys.exit(1)
+    engine = options.engine
+    io_threads = options.io_threads
+    if io_threads is None:
+        io_threads = 1 if len(sam_file_list) > 1 else 0
     
+    cell_tag, UMI_tag, max_FLAG = get_tags(options, barcodes)
+    cram_options = set_cram_options(options.ref_file, [cell_tag, UMI_tag], 
+        mates = region_file is None and not is_stream, quals = not options.no_GL)
     nproc = options.nproc
     min_MAF = options.min_MAF
     min_LEN = options.min_LEN
     min_MAPQ = options.min_MAPQ
     min_COUNT = options.min_COUNT
     doubletGL = options.doubletGL
-    max_FLAG = options.max_FLAG
-    if options.max_FLAG is None:
-        max_FLAG = DEF_FLAG_WITHOUT_UMI if UMI_tag is None else DEF_FLAG_WITH_UMI
+    no_GL = options.no_GL
+    save_raw = options.save_raw
+    feature_index = load_features(options.feature_file)
+
+    # memory budget: cap subprocesses and concurrent deep sites
+    try:
+        max_mem = parse_mem(options.max_mem)
+    except ValueError:
+        print("Error: invalid maxMEM %s" %options.max_mem)
+        sys.exit(1)
+    n_cells = None if barcodes is None else len(barcodes)
+    nproc, n_hot, worker_mem = plan_workers(nproc, max_mem, n_cells)
+    hot_sem = None if max_mem is None else multiprocessing.Semaphore(n_hot)
+    timing = options.stats_json is not None
+    if nproc > 1:
+        # workers report to one progress line, rather than each printing
+        progress_block, slot_counter = new_progress(nproc)
+        worker_args = (hot_sem, HOT_DEPTH, progress_block, slot_counter, 
+                       cram_options)
 
-    result, out_files = [], []
-    if region_file is None:
-        # pileup in each chrom
+    result, out_files, engine_logs = [], [], []
+    if is_stream:
+        # one pass over stdin in this process, sites are output as they pass
+        if nproc > 1:
+            print("[cellSNP] reading one stream from stdin, ignoring -p.")
+        out_file_tmp = out_file + ".temp_0_"
+        out_files.append(out_file_tmp)
+        if region_file is None:
+            result = [run_with_stats(stream_regions, ("-", barcodes, 
+                out_file_tmp, chrom_all, cell_tag, UMI_tag, min_COUNT, min_MAF, 
+                min_MAPQ, max_FLAG, min_LEN, doubletGL, True, io_threads, 
+                no_GL, get_raw_prefix(out_file_tmp, save_raw), groups, 
+                get_feature_counter(out_file_tmp, feature_index), 
+                (options.chrom_pattern, options.chrom_min_len)), timing)]
+            print("[cellSNP] stream pileupped, now merging all variants ...")
+        else:
+            result = [run_with_stats(stream_positions, ("-", chrom_list, 
+                pos_list, REF_list, ALT_list, barcodes, sample_ids, 
+                out_file_tmp, cell_tag, UMI_tag, min_COUNT, min_MAF, min_MAPQ, 
+                max_FLAG, min_LEN, doubletGL, True, io_threads, no_GL, 
+                get_raw_prefix(out_file_tmp, save_raw), groups, 
+                get_feature_counter(out_file_tmp, feature_index)), timing)]
+            print("[cellSNP] fetched %d variants, now merging temp files ... " 
+                  %(len(pos_list)))
+    elif region_file is None:
+        # multiple files are piled up in sync, one column for each bulk file
+        if len(sam_file_list) > 1 or barcode_affix is not None:
+            sam_files, pileup_ids = sam_file_list, sample_ids
+        else:
+            sam_files, pileup_ids = sam_file_list[0], None
+        # pileup in each chrom, or in chunks of regionsBED of about the 
+        # same bp, as (chrom, regions, bp)
+        if bed_regions is None:
+            jobs = [(x, None, None) for x in chrom_all]
+        else:
+            jobs = split_regions(chrom_all, bed_regions, nproc)
         if nproc > 1:
-            pool = multiprocessing.Pool(processes=nproc)
-            for _chrom in chrom_all:
-                chr_out_file = out_file + ".temp_%s_" %(_chrom)
+            total_cost = 0
+            for _chrom, _regions, _bp in jobs:
+                if _regions is not None:
+                    total_cost += _bp
+                else:
+                    total_cost += contigs.length(_chrom)
+            pool = multiprocessing.Pool(processes=nproc, 
+                initializer=init_worker, initargs=worker_args)
+            for ii in range(len(jobs)):
+                _chrom, _regions = jobs[ii][:2]
+                chr_out_file = out_file + ".temp_%s_%d_" %(_chrom, ii)
                 out_files.append(chr_out_file)
-                result.append(pool.apply_async(pileup_regions, (sam_file_list[0], 
-                    barcodes, chr_out_file, _chrom, cell_tag, UMI_tag, 
-                    min_COUNT, min_MAF, min_MAPQ, max_FLAG, min_LEN, doubletGL, 
-                    True), 
+                result.append(pool.apply_async(run_with_stats, (pileup_regions, 
+                    (sam_files, barcodes, chr_out_file, _chrom, cell_tag, 
+                    UMI_tag, min_COUNT, min_MAF, min_MAPQ, max_FLAG, min_LEN, 
+                    doubletGL, False, worker_mem, pileup_ids, io_threads, 
+                    barcode_affix, no_GL, 
+                    get_raw_prefix(chr_out_file, save_raw), groups, 
+                    get_feature_counter(chr_out_file, feature_index), 
+                    _regions), timing), 
                     callback=show_progress))
             pool.close()
+            monitor_progress(result, progress_block, total_cost)
             pool.join()
         else:
-            for _chrom in chrom_all:
-                chr_out_file = out_file + ".temp_%s_" %(_chrom)
+            for ii in range(len(jobs)):
+                _chrom, _regions = jobs[ii][:2]
+                chr_out_file = out_file + ".temp_%s_%d_" %(_chrom, ii)
                 out_files.append(chr_out_file)
-                pileup_regions(sam_file_list[0], barcodes, chr_out_file, _chrom, 
-                               cell_tag, UMI_tag, min_COUNT, min_MAF, min_MAPQ, 
-                               max_FLAG, min_LEN, doubletGL, True)
+                result.append(run_with_stats(pileup_regions, (sam_files, 
+                    barcodes, chr_out_file, _chrom, cell_tag, UMI_tag, 
+                    min_COUNT, min_MAF, min_MAPQ, max_FLAG, min_LEN, doubletGL, 
+                    True, worker_mem, pileup_ids, io_threads, barcode_affix, 
+                    no_GL, get_raw_prefix(chr_out_file, save_raw), groups, 
+                    get_feature_counter(chr_out_file, feature_index), 
+                    _regions), timing))
                 show_progress(1)
         result = [res.get() if nproc > 1 else res for res in result]
         print("")
@@ -234,42 +838,60 @@ def main():
         if (nproc == 1):
             out_file_tmp = out_file + ".temp_0_"
             out_files.append(out_file_tmp)
-            result = fetch_positions(sam_file_list,                 
+            engine_logs.append(out_file_tmp + "engine")
+            result = [run_with_stats(fetch_positions, (sam_file_list,                 
                 chrom_list, pos_list, REF_list, ALT_list, barcodes, sample_ids, 
                 out_file_tmp, cell_tag, UMI_tag, min_COUNT, min_MAF, 
-                min_MAPQ, max_FLAG, min_LEN, doubletGL, True) 
+                min_MAPQ, max_FLAG, min_LEN, doubletGL, True, worker_mem, 
+                engine, engine_logs[-1], io_threads, barcode_affix, no_GL, 
+                get_raw_prefix(out_file_tmp, save_raw), groups, 
+                get_feature_counter(out_file_tmp, feature_index)), timing)]
             show_progress(1)
         else:
-            LEN_div = int(len(chrom_list) / nproc)
-            pool = multiprocessing.Pool(processes=nproc)
-            for ii in range(nproc):
+            # one batch per subprocess, or smaller batches with --maxMEM
+            batches = split_sites(len(pos_list), nproc, worker_mem, n_cells)
+            pool = multiprocessing.Pool(processes=nproc, 
+                initializer=init_worker, initargs=worker_args)
+            for ii in range(len(batches)):
                 out_file_tmp = out_file + ".temp_%d_" %(ii)
                 out_files.append(out_file_tmp)
+                engine_logs.append(out_file_tmp + "engine")
 
-                if ii == nproc - 1:
-                    _pos = pos_list[LEN_div * ii : len(pos_list)]
-                    _chrom = chrom_list[LEN_div * ii : len(chrom_list)]
-                    _REF_list = REF_list[LEN_div * ii : len(REF_list)]
-                    _ALT_list = ALT_list[LEN_div * ii : len(ALT_list)]
-                else:
-                    _pos = pos_list[LEN_div * ii : LEN_div * (ii+1)]
-                    _chrom = chrom_list[LEN_div * ii : LEN_div * (ii+1)]
-                    _REF_list = REF_list[LEN_div * ii : LEN_div * (ii+1)]
-                    _ALT_list = ALT_list[LEN_div * ii : LEN_div * (ii+1)]
-
-                result.append(pool.apply_async(fetch_positions, (sam_file_list,                 
-                    _chrom, _pos, _REF_list, _ALT_list, barcodes, sample_ids, 
-                    out_file_tmp, cell_tag, UMI_tag, min_COUNT, min_MAF, 
-                    min_MAPQ, max_FLAG, min_LEN, doubletGL, True), 
+                _start, _end = batches[ii]
+                _pos = pos_list[_start : _end]
+                _chrom = chrom_list[_start : _end]
+                _REF_list = REF_list[_start : _end]
+                _ALT_list = ALT_list[_start : _end]
+
+                result.append(pool.apply_async(run_with_stats, (fetch_positions, 
+                    (sam_file_list, _chrom, _pos, _REF_list, _ALT_list, barcodes, 
+                    sample_ids, out_file_tmp, cell_tag, UMI_tag, min_COUNT, 
+                    min_MAF, min_MAPQ, max_FLAG, min_LEN, doubletGL, False, 
+                    worker_mem, engine, engine_logs[-1], io_threads, 
+                    barcode_affix, no_GL, 
+                    get_raw_prefix(out_file_tmp, save_raw), groups, 
+                    get_feature_counter(out_file_tmp, feature_index)), timing), 
                     callback=show_progress))
 
             pool.close()
+            monitor_progress(result, progress_block, len(pos_list))
             pool.join()
             result = [res.get() for res in result]
             print("")
         print("[cellSNP] fetched %d variants, now merging temp files ... " 
               %(len(pos_list)))
+        if engine != "fetch":
+            engine_file = os.path.join(os.path.dirname(out_file), 
+                                       "cellSNP.engine.tsv")
+            cnt, n_win = merge_engine_logs(engine_file, engine_logs)
+            print("[cellSNP] engine %s: %d SNPs swept in %d regions, %d SNPs "
+                  "fetched in %d regions, see %s" %(engine, cnt["sweep"], 
+                  n_win["sweep"], cnt["fetch"], n_win["fetch"], engine_file))
     
+    if save_raw:
+        save_raw_chunks(out_file, out_files)
+    if feature_index is not None:
+        save_feature_counts(out_file, out_files, feature_index)
     merge_vcf(out_file, out_files, options.save_HDF5)
 
     if options.sparse_dir is not None:
@@ -277,6 +899,19 @@ def main():
             out_dir=options.sparse_dir)
     
     run_time = time.time() - START_TIME
+    run_stats = merge_stats([res[1] for res in result])
+    print(reject_summary(run_stats))
+    if options.stats_json is not None:
+        # how the reads are counted: mode 2 on stdin has no max depth nor
+        # mate-overlap handling of pysam pileup, so its counts differ
+        if region_file is not None:
+            pileup = "fetch"
+        else:
+            pileup = "stream" if is_stream else "pysam"
+        write_stats(options.stats_json, run_stats, run_time, 
+            info={"version": __version__, "nproc": nproc, "argv": sys.argv, 
+                  "pileup": pileup})
+        print("[cellSNP] stats saved in %s" %options.stats_json)
     print("[cellSNP] All done: %d min %.1f sec" %(int(run_time / 60), 
                                                   run_time % 60))
     
@@ -0,0 +1,505 @@
+# Microbenchmarks for the per-read and per-site kernels
+# Date: 17/10/2026
+
+import tracemalloc
+import numpy as np
+import pysam
+from pysam.libcalignedsegment cimport AlignedSegment
+from .base_utils import id_mapping, unique_list
+from .cellsnp_utils cimport get_query_bases, get_query_qualities
+from .cellsnp_utils cimport query_offset, base_at, qual_at, ReadKernel
+from .pileup_utils cimport qual_vector, qual_matrix_to_geno, geno_batch, \
+    geno_sites
+from .pileup_utils import get_vcf_line, barcode_index
+from .stats_utils cimport now_sec
+
+BASES = "ACGT"
+
+## Inputs: make_<x>(rng, size, n_cells) returns the data for one repeat, with
+## size reads (or observed cells) at a site and n_cells barcodes in the list.
+
+def _rand_str(rng, n, k):
+    return ["".join(x) for x in rng.choice(list(BASES), (n, k))]
+
+def make_cells(rng, size, n_cells):
+    """Cell barcodes of reads at a site, 10% of which are not in the list,
+    and the sorted barcode list.
+    """
+    barcodes = sorted(set([x + "-1" for x in _rand_str(rng, n_cells, 16)]))
+    cell_list = [barcodes[i] for i in rng.randint(len(barcodes), size=size)]
+    for i in np.where(rng.rand(size) < 0.1)[0]:
+        cell_list[i] = _rand_str(rng, 1, 16)[0] + "-1"
+    return cell_list, barcodes
+
+def make_cell_bytes(rng, size, n_cells):
+    """As make_cells, with the cell barcodes of reads as bytes, as read by
+    the ReadKernel.
+    """
+    cell_list, barcodes = make_cells(rng, size, n_cells)
+    return [x.encode() for x in cell_list], barcodes
+
+def make_umis(rng, size, n_cells):
+    """Cell>UMI strings of reads at a site, 30% of which are duplicates.
+    """
+    cell_list, barcodes = make_cells(rng, size, n_cells)
+    umis = [cell_list[i] + ">" + x for i, x in enumerate(_rand_str(rng, size, 10))]
+    for i in np.where(rng.rand(size) < 0.3)[0]:
+        umis[i] = umis[rng.randint(size)]
+    return umis
+
+def make_reads(rng, size, n_cells):
+    """Reads of 98bp, with soft clips and splicing as in 10x data.
+    """
+    reads = []
+    for i in range(size):
+        read = pysam.AlignedSegment()
+        read.query_sequence = "".join(rng.choice(list(BASES), 98))
+        read.query_qualities = pysam.qualitystring_to_array(
+            "".join([chr(33 + x) for x in rng.randint(2, 42, 98)]))
+        clip = rng.randint(0, 10)
+        if rng.rand() < 0.2:
+            k = rng.randint(20, 78)
+            read.cigartuples = [(4, clip), (0, k - clip), (3, 500), (0, 98 - k)]
+        else:
+            read.cigartuples = [(4, clip), (0, 98 - clip)]
+        read.reference_start = 1000
+        reads.append(read)
+    return reads
+
+def make_tagged_reads(rng, size, n_cells):
+    """Reads with cell barcode (CB) and UMI (UB) tags, besides other tags.
+    """
+    reads = make_reads(rng, size, n_cells)
+    cell_list, barcodes = make_cells(rng, size, n_cells)
+    umis = _rand_str(rng, size, 10)
+    for i in range(size):
+        reads[i].set_tag("NH", 1)
+        reads[i].set_tag("CR", cell_list[i][:16])
+        reads[i].set_tag("CB", cell_list[i])
+        reads[i].set_tag("UB", umis[i])
+    return reads
+
+def make_quals(rng, size, n_cells):
+    return [int(x) for x in rng.randint(2, 42, size)]
+
+def _make_cell_counts(rng, size):
+    base_cells, qual_cells = [], []
+    for i in range(size):
+        _count = [int(x) for x in rng.multinomial(rng.randint(1, 6),
+                                                  [0.6, 0.35, 0.02, 0.02, 0.01])]
+        base_cells.append(_count)
+        qual_cells.append(np.log(rng.uniform(0.5, 1, (5, 4))) *
+                          np.array(_count)[:, None])
+    return base_cells, qual_cells
+
+def make_genos(rng, size, n_cells):
+    """Quality matrix and base counts of size observed cells, with A as REF
+    and C as ALT.
+    """
+    base_cells, qual_cells = _make_cell_counts(rng, size)
+    return [(qual_cells[i], base_cells[i], "A", "C") for i in range(size)]
+
+def make_vcf_site(rng, size, n_cells):
+    """A site with size observed cells out of n_cells.
+    """
+    base_cells, qual_cells = _make_cell_counts(rng, size)
+    base_cells += [[0, 0, 0, 0, 0] for i in range(max(n_cells - size, 0))]
+    qual_cells += [np.zeros((5, 4)) for i in range(max(n_cells - size, 0))]
+    base_merge = dict(zip("ACGTN", np.sum(base_cells, axis=0).tolist()))
+    return base_merge, base_cells, qual_cells
+
+def make_geno_edges(rng, n_cells):
+    """Quality matrices and base counts of n_cells observed cells at the
+    edges of the model: one read, qualities at or beyond minBQ and capBQ of
+    qual_vector, deep cells, only other bases or N, and PL of GL1 halfway
+    between two integers. Cells without reads have no GL (see get_vcf_line).
+    """
+    base_cells, qual_cells = [], []
+    _edges = [0, 0.1, 0.25, 1, 2, 20, 45, 60]
+    for i in range(n_cells):
+        _case = i % 6
+        _count = np.zeros(5, dtype=int)
+        if _case == 0:
+            _count[rng.randint(5)] = 1
+        elif _case == 1:
+            _count[rng.randint(2)] = rng.randint(1000, 100000)
+        elif _case == 2:
+            _count[2 + rng.randint(3)] = rng.randint(1, 50)
+        elif _case == 3:
+            _count[0] = rng.randint(1, 200)
+        else:
+            _count[:] = rng.multinomial(rng.randint(1, 200),
+                                        rng.dirichlet(np.ones(5) * 0.3))
+        # up to 50 qualities per base, scaled to the count for deep cells
+        _qual = np.zeros((5, 4))
+        for b in range(5):
+            _n = min(_count[b], 50)
+            for k in range(_n):
+                if _case == 5:
+                    _qual[b, :] += qual_vector(rng.uniform(0, 45))
+                else:
+                    _qual[b, :] += qual_vector(_edges[rng.randint(8)])
+            if _n > 0:
+                _qual[b, :] *= _count[b] / float(_n)
+        if _case == 3:
+            _qual[0, 0] = -(rng.randint(0, 1000) + 0.5) * np.log(10) / 10.0
+        base_cells.append([int(x) for x in _count])
+        qual_cells.append(_qual)
+    return base_cells, qual_cells
+
+def compare_geno_batch(n_cells=10000, seed=0):
+    """Compare GT and PL of geno_batch with qual_matrix_to_geno, for all REF
+    and ALT pairs, with and without doublet_GL, on make_geno_edges cells; 
+    and of geno_sites with geno_batch, on sites of up to 50 of the cells with
+    all REF and ALT pairs in one call.
+    Return the mismatches as (REF, ALT, doublet_GL, cell, expected, got).
+    """
+    rng = np.random.RandomState(seed)
+    base_cells, qual_cells = make_geno_edges(rng, n_cells)
+    mismatches = []
+    for REF in "ACGTN":
+        for ALT in "ACGTN":
+            if REF == ALT:
+                continue
+            for doublet_GL in [False, True]:
+                gt, pl = geno_batch(qual_cells, base_cells, REF, ALT,
+                                    doublet_GL)
+                for i in range(n_cells):
+                    _expect = qual_matrix_to_geno(qual_cells[i],
+                        base_cells[i], REF, ALT, doublet_GL)
+                    _got = (["0/0", "1/0", "1/1"][gt[i]],
+                            ",".join(["%d" %x for x in pl[:, i]]))
+                    if _got != _expect:
+                        mismatches.append((REF, ALT, doublet_GL, i,
+                                           _expect, _got))
+
+    _pairs = [(x, y) for x in "ACGTN" for y in "ACGTN" if x != y]
+    for doublet_GL in [False, True]:
+        sites, start = [], 0
+        while start < n_cells:
+            _end = min(n_cells, start + rng.randint(0, 51))
+            REF, ALT = _pairs[len(sites) % len(_pairs)]
+            sites.append((qual_cells[start : _end], base_cells[start : _end], 
+                          REF, ALT, start))
+            start = _end
+        genos = geno_sites([x[:4] for x in sites], doublet_GL)
+        for k in range(len(sites)):
+            _qual, _cnt, REF, ALT, start = sites[k]
+            gt, pl = geno_batch(_qual, _cnt, REF, ALT, doublet_GL)
+            for i in range(len(_cnt)):
+                _expect = (["0/0", "1/0", "1/1"][gt[i]],
+                           ",".join(["%d" %x for x in pl[:, i]]))
+                _got = (["0/0", "1/0", "1/1"][genos[k][0][i]],
+                        ",".join(["%d" %x for x in genos[k][1][:, i]]))
+                if _got != _expect:
+                    mismatches.append((REF, ALT, doublet_GL, start + i,
+                                       _expect, _got))
+    return mismatches
+
+## Runners: run_<kernel>(data, n_rep) returns (seconds, number of ops)
+
+def run_id_mapping(data, int n_rep):
+    cell_list, barcodes = data
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        id_mapping(cell_list, barcodes, uniq_ref_only=False, IDs2_sorted=True)
+    return now_sec() - t0, n_rep
+
+def run_barcode_index(data, int n_rep):
+    cell_list, barcodes = data
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        _index = barcode_index(barcodes)
+        [_index.get(x) for x in cell_list]
+    return now_sec() - t0, n_rep
+
+def run_unique_list(data, int n_rep):
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        unique_list(data)
+    return now_sec() - t0, n_rep
+
+def run_get_query_bases(data, int n_rep):
+    cdef int i
+    cdef AlignedSegment read
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        for read in data:
+            get_query_bases(read, full_length = False)
+    return now_sec() - t0, n_rep * len(data)
+
+def run_get_query_qualities(data, int n_rep):
+    cdef int i
+    cdef AlignedSegment read
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        for read in data:
+            get_query_qualities(read, full_length = False)
+    return now_sec() - t0, n_rep * len(data)
+
+## base and quality of each read at a site, as the reads were decoded before
+## (python lists of the read) and now (from the packed bam1_t)
+SITE_POS = 1040
+
+def run_read_base_qual_list(data, int n_rep):
+    cdef int i
+    cdef AlignedSegment read
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        for read in data:
+            try:
+                idx = read.positions.index(SITE_POS)
+            except ValueError:
+                continue
+            get_query_bases(read, full_length = False)[idx].upper()
+            get_query_qualities(read, full_length = False)[idx]
+    return now_sec() - t0, n_rep * len(data)
+
+def run_read_base_qual_nogil(data, int n_rep):
+    cdef int i, idx
+    cdef long pos = SITE_POS
+    cdef AlignedSegment read
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        for read in data:
+            idx = query_offset(read._delegate, pos)
+            if idx < 0:
+                continue
+            "ACGTN"[base_at(read._delegate, idx)]
+            qual_at(read._delegate, idx)
+    return now_sec() - t0, n_rep * len(data)
+
+## cell and UMI tags of each read, by has_tag and get_tag (each scans the aux
+## block) or by the ReadKernel, with one bam_aux_get per tag
+def run_read_tags_pysam(data, int n_rep):
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        for read in data:
+            if read.has_tag("CB") and read.has_tag("UB"):
+                read.get_tag("CB") + '>' + read.get_tag("UB")
+                read.get_tag("CB")
+    return now_sec() - t0, n_rep * len(data)
+
+def run_read_tags_aux(data, int n_rep):
+    cdef int i
+    cdef AlignedSegment read
+    cdef ReadKernel kernel = ReadKernel("CB", "UB", 0, 4096, 0)
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        for read in data:
+            kernel.check(read)
+    return now_sec() - t0, n_rep * len(data)
+
+def run_qual_vector(data, int n_rep):
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        for _qual in data:
+            qual_vector(_qual)
+    return now_sec() - t0, n_rep * len(data)
+
+def run_qual_matrix_to_geno(data, int n_rep):
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        for _qual, _count, _REF, _ALT in data:
+            qual_matrix_to_geno(_qual, _count, _REF, _ALT, False)
+    return now_sec() - t0, n_rep * len(data)
+
+def run_geno_batch(data, int n_rep):
+    quals = [x[0] for x in data]
+    counts = [x[1] for x in data]
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        geno_batch(quals, counts, "A", "C", False)
+    return now_sec() - t0, n_rep * len(data)
+
+def run_geno_sites(data, int n_rep):
+    # sites of 10 cells, GT and PL of all sites in one kernel call
+    sites = [([x[0] for x in data[k : k + 10]], 
+              [x[1] for x in data[k : k + 10]], "A", "C") 
+             for k in range(0, len(data), 10)]
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        geno_sites(sites, False)
+    return now_sec() - t0, n_rep * len(data)
+
+def run_geno_batch_sites(data, int n_rep):
+    # sites of 10 cells, a kernel call per site
+    sites = [([x[0] for x in data[k : k + 10]], 
+              [x[1] for x in data[k : k + 10]]) 
+             for k in range(0, len(data), 10)]
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        for _quals, _counts in sites:
+            geno_batch(_quals, _counts, "A", "C", False)
+    return now_sec() - t0, n_rep * len(data)
+
+## the str formatter of get_vcf_line before vcf_format.h and geno_batch, kept
+## as the reference of the native one: GT and PL by qual_matrix_to_geno and a
+## str per cell field, joined per line; no_GL as AD:DP:OTH:ALL
+def get_vcf_line_str(base_merge, base_cells, qual_cells, chrom, POS, min_COUNT, 
+                     min_MAF, REF=None, ALT=None, doublet_GL=False, 
+                     no_GL=False):
+    base_sorted = sorted(base_merge, key=base_merge.__getitem__, reverse=True)
+    if REF is None or ALT is None:
+        REF = base_sorted[0]
+        ALT = base_sorted[1]
+            
+    min_cnt_2nd = min_MAF * sum(base_merge.values())      
+    if (sum(base_merge.values()) < min_COUNT or 
+        base_merge[base_sorted[1]] < min_cnt_2nd):
+        return None
+
+    FORMAT = "AD:DP:OTH:ALL" if no_GL else "GT:AD:DP:OTH:PL:ALL"
+    REF_cnt = base_merge[REF]
+    ALT_cnt = base_merge[ALT]
+    OTH_cnt = sum(base_merge.values()) - REF_cnt - ALT_cnt
+    
+    INFO = "AD=%d;DP=%d;OTH=%d" %(ALT_cnt, ALT_cnt+REF_cnt, OTH_cnt)
+    
+    cells_str = []
+    for i in range(len(base_cells)):
+        _base_cell = base_cells[i]
+        if sum(_base_cell) == 0:
+            cells_str.append(".:.:.:." if no_GL else ".:.:.:.:.:.")
+        else:
+            _REF_cnt = _base_cell["ACGTN".index(REF)]
+            _ALT_cnt = _base_cell["ACGTN".index(ALT)]
+            _OTH_cnt = sum(_base_cell) - _REF_cnt - _ALT_cnt
+    
+            all_str = ",".join([str(x) for x in _base_cell])
+            cnt_lst = [str(_ALT_cnt), str(_ALT_cnt + _REF_cnt), str(_OTH_cnt)]
+            if no_GL:
+                cells_str.append(":".join(cnt_lst + [all_str]))
+                continue
+
+            ### GT and GL
+            _GT, _GL = qual_matrix_to_geno(qual_cells[i], _base_cell, REF, 
+                                           ALT, doublet_GL)
+            out_lst = ":".join([_GT] + cnt_lst + [_GL, all_str])
+            cells_str.append(out_lst)
+    
+    vcf_val = [chrom, str(POS), ".", REF, ALT, ".", "PASS", INFO, FORMAT]
+    return "\t".join(vcf_val + cells_str) + "\n"
+
+def compare_vcf_line(n_sites=300, n_cells=200, seed=0):
+    """Compare the lines of get_vcf_line with get_vcf_line_str, as bytes, 
+    with GL, doublet_GL and no_GL, on sites mixing make_geno_edges cells and
+    cells without reads, with given or counted REF and ALT.
+    Return the mismatches as (site, mode, expected, got).
+    """
+    rng = np.random.RandomState(seed)
+    mismatches = []
+    for k in range(n_sites):
+        _n_obs = rng.randint(0, n_cells + 1)
+        _cnts, _quals = make_geno_edges(rng, _n_obs)
+        _obs = np.sort(rng.choice(n_cells, _n_obs, replace=False))
+        base_cells = [[0, 0, 0, 0, 0] for i in range(n_cells)]
+        qual_cells = [np.zeros((5, 4)) for i in range(n_cells)]
+        for i in range(_n_obs):
+            base_cells[_obs[i]] = _cnts[i]
+            qual_cells[_obs[i]] = _quals[i]
+        base_merge = dict(zip("ACGTN", 
+            [int(x) for x in np.sum(base_cells, axis=0)]))
+        chrom = ["1", "chrX", "GL000220.1"][k % 3]
+        POS = int(rng.randint(1, 3e8))
+        if k % 2 == 0:
+            REF, ALT = None, None
+            POS = str(POS)   # as loaded from a vcf panel
+        else:
+            REF, ALT = [str(x) for x in rng.choice(list("ACGTN"), 2, 
+                                                   replace=False)]
+        min_COUNT, min_MAF = [(0, 0.0), (20, 0.1)][k % 4 // 2]
+        for mode in ["GL", "doublet_GL", "no_GL"]:
+            _args = (base_merge, base_cells, qual_cells, chrom, POS, 
+                     min_COUNT, min_MAF, REF, ALT, mode == "doublet_GL", 
+                     mode == "no_GL")
+            _expect = get_vcf_line_str(*_args)
+            if _expect is not None:
+                _expect = _expect.encode()
+            _got = get_vcf_line(*_args)
+            if _got != _expect:
+                mismatches.append((k, mode, _expect, _got))
+    return mismatches
+
+def run_get_vcf_line_str(data, int n_rep):
+    base_merge, base_cells, qual_cells = data
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        get_vcf_line_str(base_merge, base_cells, qual_cells, "1", 1000, 0, 0.0,
+                         "A", "C", False)
+    return now_sec() - t0, n_rep
+
+def run_get_vcf_line(data, int n_rep):
+    base_merge, base_cells, qual_cells = data
+    cdef int i
+    cdef double t0 = now_sec()
+    for i in range(n_rep):
+        get_vcf_line(base_merge, base_cells, qual_cells, "1", 1000, 0, 0.0,
+                     "A", "C", False)
+    return now_sec() - t0, n_rep
+
+## kernel, variant, input maker and runner. Native replacements of a kernel
+## are added as another variant with the same kernel name and input.
+KERNELS = [
+    ("id_mapping", "python", make_cells, run_id_mapping),
+    ("id_mapping", "bytes_index", make_cell_bytes, run_barcode_index),
+    ("unique_list", "python", make_umis, run_unique_list),
+    ("get_query_bases", "cython", make_reads, run_get_query_bases),
+    ("get_query_qualities", "cython", make_reads, run_get_query_qualities),
+    ("read_base_qual", "list", make_reads, run_read_base_qual_list),
+    ("read_base_qual", "nogil", make_reads, run_read_base_qual_nogil),
+    ("read_tags", "pysam", make_tagged_reads, run_read_tags_pysam),
+    ("read_tags", "aux", make_tagged_reads, run_read_tags_aux),
+    ("qual_vector", "cython", make_quals, run_qual_vector),
+    ("qual_matrix_to_geno", "cython", make_genos, run_qual_matrix_to_geno),
+    ("qual_matrix_to_geno", "simd", make_genos, run_geno_batch),
+    ("qual_matrix_to_geno", "simd_per_site", make_genos, run_geno_batch_sites),
+    ("qual_matrix_to_geno", "simd_sites", make_genos, run_geno_sites),
+    ("get_vcf_line", "python", make_vcf_site, run_get_vcf_line_str),
+    ("get_vcf_line", "buffer", make_vcf_site, run_get_vcf_line),
+]
+
+def run_benchmarks(sizes=[10, 100, 1000], n_cells=5000, min_time=0.2,
+                   kernels=None, seed=0):
+    """Time each kernel variant over the input sizes.
+
+    Each variant is repeated until it takes min_time seconds. Return a list
+    of records with ns/op, and the peak memory allocated by one repeat (by
+    tracemalloc, i.e., Python objects and numpy arrays).
+    """
+    records = []
+    for name, variant, maker, runner in KERNELS:
+        if kernels is not None and name not in kernels:
+            continue
+        for size in sizes:
+            rng = np.random.RandomState(seed)
+            data = maker(rng, size, n_cells)
+            runner(data, 1)    # warm up
+
+            tracemalloc.start()
+            runner(data, 1)
+            peak_bytes = tracemalloc.get_traced_memory()[1]
+            tracemalloc.stop()
+
+            n_rep, sec, n_ops = 1, 0, 1
+            while True:
+                sec, n_ops = runner(data, n_rep)
+                if sec >= min_time or n_rep >= 1e7:
+                    break
+                n_rep *= 10 if sec < min_time / 10 else 2
+            records.append({"kernel": name, "variant": variant, "size": size,
+                            "n_cells": n_cells, "repeats": n_rep,
+                            "ns_per_op": sec * 1e9 / max(n_ops, 1),
+                            "ops_per_repeat": n_ops // n_rep,
+                            "peak_alloc_bytes": peak_bytes})
+    return records
@@ -1,4 +1,5 @@
 
+from pysam.libchtslib cimport bam1_t
 from pysam.libcalignedsegment cimport AlignedSegment
 
 cdef double c_max(double x, double y)
@@ -7,6 +8,28 @@ cdef double c_min(double x, double y)
 cdef get_query_bases(AlignedSegment read, bint full_length=*)
 cdef get_query_qualities(AlignedSegment read, bint full_length=*)
 
+cdef int query_offset(bam1_t *b, long ref_pos) nogil
+cdef int aligned_length(bam1_t *b) nogil
+cdef int base_at(bam1_t *b, int qpos) nogil
+cdef int qual_at(bam1_t *b, int qpos) nogil
+
+cdef const char* aux_str(bam1_t *b, const char *tag) nogil
+cdef tag_value(AlignedSegment read, bytes tag)
+cdef bytes tag_bytes(tag)
+
+ctypedef int (*check_fn_t)(object, AlignedSegment) except? -2
+ctypedef int (*add_fn_t)(object, AlignedSegment, int, tuple) except? -2
+
+cdef class ReadKernel:
+    cdef readonly int min_MAPQ, max_FLAG, min_LEN
+    cdef readonly bytes cell_tag, UMI_tag
+    cdef readonly bint with_qual
+    cdef object cell, UMI
+    cdef check_fn_t check_fn
+    cdef add_fn_t add_fn
+    cdef int check(self, AlignedSegment read) except? -2
+    cdef int add(self, AlignedSegment read, int qpos, tuple lists) except? -2
+
 """
 ctypedef struct c_idxstr_t:
     char *s
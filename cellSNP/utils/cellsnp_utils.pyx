@@ -1,7 +1,14 @@
 
-from libc.stdint cimport uint32_t
+from libc.stdint cimport uint8_t, uint32_t
+from libc.string cimport memcpy, strlen
+from cpython.bytes cimport PyBytes_FromStringAndSize, PyBytes_AS_STRING
 from pysam.libchtslib cimport BAM_CDIFF, BAM_CEQUAL, BAM_CINS, BAM_CMATCH, BAM_CSOFT_CLIP
+from pysam.libchtslib cimport BAM_CDEL, BAM_CREF_SKIP
+from pysam.libchtslib cimport bam1_t, bam_get_cigar, bam_get_seq, bam_get_qual
+from pysam.libchtslib cimport bam_seqi, bam_cigar_op, bam_cigar_oplen, bam_aux_get
+from pysam.libchtslib cimport bam_aux2i, bam_aux2f, bam_aux2A
 from pysam.libcalignedsegment cimport AlignedSegment
+from .stats_utils cimport REJ_MAPQ, REJ_FLAG, REJ_LEN, REJ_NO_CELL, REJ_NO_UMI
 
 cdef double c_max(double x, double y):
     return x if x > y else y
@@ -9,6 +16,306 @@ cdef double c_max(double x, double y):
 cdef double c_min(double x, double y):
     return x if x < y else y
 
+## index in ACGTN of the 4-bit bases "=ACMGRSVTWYHKDBN", ambiguous ones as N
+cdef int NT16_IDX[16]
+NT16_IDX[:] = [4, 0, 1, 4, 2, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4]
+
+cdef int query_offset(bam1_t *b, long ref_pos) nogil:
+    """
+    @abstract            Query offset of the base aligned (M/=/X) to a reference position.
+    @param b             Pointer to the bam1_t of a read. [bam1_t*]
+    @param ref_pos       0-based reference position. [long]
+    @return              The query offset, or -1 if the position is deleted, skipped or not 
+                         covered by the read, or the read has no sequence. [int]
+    """
+    cdef uint32_t *cigar = bam_get_cigar(b)
+    cdef uint32_t k, l
+    cdef int op
+    cdef long r = b.core.pos
+    cdef int q = 0
+    if b.core.l_qseq == 0:
+        return -1
+    for k in range(b.core.n_cigar):
+        if ref_pos < r:
+            return -1
+        op = bam_cigar_op(cigar[k])
+        l = bam_cigar_oplen(cigar[k])
+        if op == BAM_CMATCH or op == BAM_CEQUAL or op == BAM_CDIFF:
+            if ref_pos < r + l:
+                return q + <int>(ref_pos - r)
+            r += l
+            q += l
+        elif op == BAM_CSOFT_CLIP or op == BAM_CINS:
+            q += l
+        elif op == BAM_CDEL or op == BAM_CREF_SKIP:
+            r += l
+    return -1
+
+cdef int aligned_length(bam1_t *b) nogil:
+    """
+    @abstract            Number of bases aligned (M/=/X), i.e., len(read.positions).
+    @param b             Pointer to the bam1_t of a read. [bam1_t*]
+    @return              The aligned length. [int]
+    """
+    cdef uint32_t *cigar = bam_get_cigar(b)
+    cdef uint32_t k
+    cdef int op, n = 0
+    for k in range(b.core.n_cigar):
+        op = bam_cigar_op(cigar[k])
+        if op == BAM_CMATCH or op == BAM_CEQUAL or op == BAM_CDIFF:
+            n += bam_cigar_oplen(cigar[k])
+    return n
+
+cdef int base_at(bam1_t *b, int qpos) nogil:
+    """
+    @abstract            Base at a query offset from the packed sequence, as index in ACGTN.
+    """
+    return NT16_IDX[bam_seqi(bam_get_seq(b), qpos)]
+
+cdef int qual_at(bam1_t *b, int qpos) nogil:
+    """
+    @abstract            Base quality at a query offset, not ASCII-encoded (255 if missing).
+    """
+    return bam_get_qual(b)[qpos]
+
+cdef const char* aux_str(bam1_t *b, const char *tag) nogil:
+    """
+    @abstract            Value of a string (Z or H type) aux tag, looked up once in the aux block.
+    @param b             Pointer to the bam1_t of a read. [bam1_t*]
+    @param tag           Two-character tag, e.g., "CB". [const char*]
+    @return              Pointer to the NUL-terminated value in the aux block, or NULL if the tag 
+                         is absent or not a string. [const char*]
+    """
+    cdef uint8_t *s = bam_aux_get(b, tag)
+    if s == NULL or (s[0] != b'Z' and s[0] != b'H'):
+        return NULL
+    return <const char*>(s + 1)
+
+cdef aux_value(AlignedSegment read, uint8_t *s, bytes tag):
+    """
+    @abstract            Value of an aux tag as a str, from its pointer in the aux block.
+    @param s             Pointer returned by bam_aux_get, not NULL. [uint8_t*]
+    @note                Tags of other types than string (rare for cell, UMI and sample tags) are 
+                         converted by str(), as they are written in the barcode list; only arrays 
+                         are read again by pysam.
+    """
+    if s[0] == b'Z' or s[0] == b'H':
+        return (<const char*>(s + 1)).decode("ascii")
+    if s[0] == b'f' or s[0] == b'd':
+        return str(bam_aux2f(s))
+    if s[0] == b'A':
+        return chr(bam_aux2A(s))
+    if s[0] == b'B':
+        return str(read.get_tag(tag.decode("ascii")))
+    return str(bam_aux2i(s))
+
+cdef tag_value(AlignedSegment read, bytes tag):
+    """
+    @abstract            Value of an aux tag as a str, None if absent, looked up once.
+    """
+    cdef uint8_t *s = bam_aux_get(read._delegate, tag)
+    if s == NULL:
+        return None
+    return aux_value(read, s, tag)
+
+cdef bytes umi_key(AlignedSegment read, const char *cell, object cell_str, 
+                   uint8_t *s, bytes tag):
+    """
+    @abstract            UMI key of a read as bytes, cell>UMI, or the UMI if cell_str is None.
+    @param cell          Cell barcode in the aux block, NULL if it is not a string tag. [char*]
+    @param cell_str      Cell barcode as bytes, used if cell is NULL. [bytes]
+    @param s             Pointer of the UMI tag returned by bam_aux_get, not NULL. [uint8_t*]
+    @note                The key is copied from the aux block into one bytes object, so no str 
+                         is made per read; it is only grouped, never compared with barcodes.
+    """
+    cdef bytes _umi, key
+    cdef const char *u
+    cdef char *p
+    cdef size_t n_c, n_u
+    if s[0] == b'Z' or s[0] == b'H':
+        u = <const char*>(s + 1)
+    else:
+        _umi = aux_value(read, s, tag).encode("ascii")
+        u = _umi
+    if cell_str is None:
+        return u
+    if cell == NULL:
+        cell = cell_str
+    n_c, n_u = strlen(cell), strlen(u)
+    key = PyBytes_FromStringAndSize(NULL, n_c + 1 + n_u)
+    p = PyBytes_AS_STRING(key)
+    memcpy(p, cell, n_c)
+    p[n_c] = b'>'
+    memcpy(p + n_c + 1, u, n_u)
+    return key
+
+cdef bytes tag_bytes(tag):
+    """Tag name (str) as bytes for aux_str and ReadKernel, None if not used."""
+    return None if tag is None else tag.encode("ascii")
+
+## Marker types of the options a ReadKernel is specialised on at compile time,
+## i.e., using the cell tag, the UMI tag and the base qualities, so the 
+## per-read code of each combination has no branches on the options.
+ctypedef struct opt_on_t:
+    char on
+ctypedef struct opt_off_t:
+    char off
+
+ctypedef fused cell_opt_t:
+    opt_on_t
+    opt_off_t
+
+ctypedef fused umi_opt_t:
+    opt_on_t
+    opt_off_t
+
+ctypedef fused qual_opt_t:
+    opt_on_t
+    opt_off_t
+
+cdef inline int _check(object obj, AlignedSegment read, cell_opt_t *c, 
+                       umi_opt_t *u) except? -2:
+    cdef ReadKernel k = <ReadKernel>obj
+    cdef bam1_t *b = read._delegate
+    cdef uint8_t *s
+    cdef const char *cell = NULL
+    if b.core.qual < k.min_MAPQ:
+        return REJ_MAPQ
+    if b.core.flag > k.max_FLAG:
+        return REJ_FLAG
+    if aligned_length(b) < k.min_LEN:
+        return REJ_LEN
+    if cell_opt_t is opt_on_t:
+        s = bam_aux_get(b, k.cell_tag)
+        if s == NULL:
+            return REJ_NO_CELL
+        # bytes copied from the aux block, without decoding a str; they are 
+        # looked up in the bytes index of the barcodes (see barcode_index)
+        if s[0] == b'Z' or s[0] == b'H':
+            cell = <const char*>(s + 1)
+            k.cell = <bytes>cell
+        else:
+            k.cell = aux_value(read, s, k.cell_tag).encode("ascii")
+    if umi_opt_t is opt_on_t:
+        s = bam_aux_get(b, k.UMI_tag)
+        if s == NULL:
+            return REJ_NO_UMI
+        if cell_opt_t is opt_on_t:
+            k.UMI = umi_key(read, cell, k.cell, s, k.UMI_tag)
+        else:
+            k.UMI = umi_key(read, NULL, None, s, k.UMI_tag)
+    return -1
+
+cdef inline int _add(object obj, AlignedSegment read, int qpos, tuple lists,
+                     cell_opt_t *c, umi_opt_t *u, qual_opt_t *q) except? -2:
+    cdef ReadKernel k = <ReadKernel>obj
+    cdef bam1_t *b = read._delegate
+    (<list>lists[0]).append("ACGTN"[base_at(b, qpos)])
+    if qual_opt_t is opt_on_t:
+        (<list>lists[1]).append(qual_at(b, qpos))
+    if umi_opt_t is opt_on_t:
+        (<list>lists[2]).append(k.UMI)
+    if cell_opt_t is opt_on_t:
+        (<list>lists[3]).append(k.cell)
+    return 0
+
+cdef int _check_cell_umi(object k, AlignedSegment read) except? -2:
+    return _check(k, read, <opt_on_t*>NULL, <opt_on_t*>NULL)
+
+cdef int _check_cell(object k, AlignedSegment read) except? -2:
+    return _check(k, read, <opt_on_t*>NULL, <opt_off_t*>NULL)
+
+cdef int _check_umi(object k, AlignedSegment read) except? -2:
+    return _check(k, read, <opt_off_t*>NULL, <opt_on_t*>NULL)
+
+cdef int _check_bulk(object k, AlignedSegment read) except? -2:
+    return _check(k, read, <opt_off_t*>NULL, <opt_off_t*>NULL)
+
+cdef int _add_cell_umi(object k, AlignedSegment read, int qpos, 
+                       tuple lists) except? -2:
+    return _add(k, read, qpos, lists, <opt_on_t*>NULL, <opt_on_t*>NULL, 
+                <opt_on_t*>NULL)
+
+cdef int _add_cell(object k, AlignedSegment read, int qpos, 
+                   tuple lists) except? -2:
+    return _add(k, read, qpos, lists, <opt_on_t*>NULL, <opt_off_t*>NULL, 
+                <opt_on_t*>NULL)
+
+cdef int _add_umi(object k, AlignedSegment read, int qpos, 
+                  tuple lists) except? -2:
+    return _add(k, read, qpos, lists, <opt_off_t*>NULL, <opt_on_t*>NULL, 
+                <opt_on_t*>NULL)
+
+cdef int _add_bulk(object k, AlignedSegment read, int qpos, 
+                   tuple lists) except? -2:
+    return _add(k, read, qpos, lists, <opt_off_t*>NULL, <opt_off_t*>NULL, 
+                <opt_on_t*>NULL)
+
+## without base qualities, i.e., nothing is added to the quality list
+cdef int _add_cell_umi_noq(object k, AlignedSegment read, int qpos, 
+                           tuple lists) except? -2:
+    return _add(k, read, qpos, lists, <opt_on_t*>NULL, <opt_on_t*>NULL, 
+                <opt_off_t*>NULL)
+
+cdef int _add_cell_noq(object k, AlignedSegment read, int qpos, 
+                       tuple lists) except? -2:
+    return _add(k, read, qpos, lists, <opt_on_t*>NULL, <opt_off_t*>NULL, 
+                <opt_off_t*>NULL)
+
+cdef int _add_umi_noq(object k, AlignedSegment read, int qpos, 
+                      tuple lists) except? -2:
+    return _add(k, read, qpos, lists, <opt_off_t*>NULL, <opt_on_t*>NULL, 
+                <opt_off_t*>NULL)
+
+cdef int _add_bulk_noq(object k, AlignedSegment read, int qpos, 
+                       tuple lists) except? -2:
+    return _add(k, read, qpos, lists, <opt_off_t*>NULL, <opt_off_t*>NULL, 
+                <opt_off_t*>NULL)
+
+cdef class ReadKernel:
+    """
+    @abstract            Per-read kernel of a run: filter a read, read its cell and UMI tags once 
+                         each, and add its base, quality, UMI key (cell>UMI, or UMI without cell 
+                         tag) and cell barcode, both as bytes, at a site to the four lists of the 
+                         site.
+    @note                The variant for the used tags is chosen once when created, as function 
+                         pointers to the specialisations of _check and _add. Without with_qual, the 
+                         base qualities are not read and the quality list is left empty.
+    """
+    def __cinit__(self, cell_tag=None, UMI_tag=None, int min_MAPQ=20, 
+                  int max_FLAG=255, int min_LEN=30, bint with_qual=True):
+        self.cell_tag = tag_bytes(cell_tag)
+        self.UMI_tag = tag_bytes(UMI_tag)
+        self.min_MAPQ = min_MAPQ
+        self.max_FLAG = max_FLAG
+        self.min_LEN = min_LEN
+        self.with_qual = with_qual
+        if cell_tag is not None and UMI_tag is not None:
+            self.check_fn = _check_cell_umi
+            self.add_fn = _add_cell_umi if with_qual else _add_cell_umi_noq
+        elif cell_tag is not None:
+            self.check_fn = _check_cell
+            self.add_fn = _add_cell if with_qual else _add_cell_noq
+        elif UMI_tag is not None:
+            self.check_fn = _check_umi
+            self.add_fn = _add_umi if with_qual else _add_umi_noq
+        else:
+            self.check_fn = _check_bulk
+            self.add_fn = _add_bulk if with_qual else _add_bulk_noq
+
+    cdef int check(self, AlignedSegment read) except? -2:
+        """
+        @abstract        Apply the read filters, keeping the tags of the read for add.
+        @return          -1 if the read is kept, otherwise the REJ_* reason. [int]
+        """
+        return self.check_fn(self, read)
+
+    cdef int add(self, AlignedSegment read, int qpos, tuple lists) except? -2:
+        """
+        @abstract        Add a read checked last, at a query offset, to the lists of a site.
+        """
+        return self.add_fn(self, read, qpos, lists)
+
 cdef get_query_bases(AlignedSegment read, bint full_length=False):
     """
     @abstract            Return a list of bases in qurey sequence that are within the alignment.
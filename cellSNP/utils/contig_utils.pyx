@@ -0,0 +1,72 @@
+# Utilility functions for the contigs of a sam file header, shared by the SNP
+# panel, the sam files and the contig lines of the output VCF
+# Date: 17/10/2026
+
+import re
+
+## names of the mitochondrial contig in different references
+MITO_NAMES = ["chrM", "chrMT", "M", "MT"]
+
+def chrom_aliases(chrom):
+    """Names of chrom in references with or without the chr prefix, e.g.,
+    1 for chr1, and chrMT, M or MT for chrM.
+    """
+    if chrom in MITO_NAMES:
+        return [x for x in MITO_NAMES if x != chrom]
+    return [chrom[3:] if chrom.startswith("chr") else "chr" + chrom]
+
+
+class ContigMap(object):
+    """The contigs of a sam file header, with integer ids (tid, the index in
+    the header) looked up by name or alias (see chrom_aliases). It is built
+    once per sam file, so resolving a chrom is a dict lookup rather than a
+    scan of the references.
+    """
+    def __init__(self, names, lengths):
+        self.names = list(names)
+        self.lengths = list(lengths)
+        self.tids = {}
+        for tid in range(len(self.names)):
+            self.tids[self.names[tid]] = tid
+        # aliases after all names, so a name is never shadowed by an alias
+        for tid in range(len(self.names)):
+            for _alias in chrom_aliases(self.names[tid]):
+                if _alias not in self.tids:
+                    self.tids[_alias] = tid
+
+    @classmethod
+    def from_sam(cls, samFile):
+        return cls(samFile.references, samFile.lengths)
+
+    def __len__(self):
+        return len(self.names)
+
+    def tid(self, chrom):
+        """Id of chrom (name or alias), -1 if not in the header.
+        """
+        return self.tids.get(chrom, -1)
+
+    def resolve(self, chrom):
+        """Name of chrom in the header, None if not in it.
+        """
+        tid = self.tids.get(chrom, -1)
+        return None if tid < 0 else self.names[tid]
+
+    def length(self, chrom):
+        tid = self.tids.get(chrom, -1)
+        return 0 if tid < 0 else self.lengths[tid]
+
+    def select(self, pattern=None, min_len=0):
+        """Names of the contigs fully matching the regular expression pattern
+        (all if None) and not shorter than min_len, in the header order.
+        """
+        _re = None if pattern is None else re.compile(pattern)
+        return [self.names[k] for k in range(len(self.names))
+                if self.lengths[k] >= min_len and
+                (_re is None or _re.fullmatch(self.names[k]) is not None)]
+
+    def vcf_header(self):
+        """The ##contig lines of a VCF header, with the lengths.
+        """
+        return "".join(["##contig=<ID=%s,length=%d>\n" %(self.names[k],
+                        self.lengths[k]) for k in range(len(self.names))])
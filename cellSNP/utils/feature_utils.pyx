@@ -0,0 +1,184 @@
+# Utilility functions for summing the per-cell allele counts of the output
+# SNPs over features, e.g., genes or regions in a BED file
+# Date: 17/10/2026
+
+import os
+import numpy as np
+from bisect import bisect_right
+from .contig_utils import chrom_aliases
+
+FEATURE_CHUNK_NNZ = 2000000    # entries held before summing duplicates
+FEATURE_LIST = "cellSNP.features.tsv"
+
+class FeatureIndex(object):
+    """Interval index of the features in a BED file (0-based start, end, and
+    an optional name in the 4th column, chrom:start-end if missing). The
+    intervals of the same name are one feature, e.g., the exons of a gene.
+    Each chrom is split at all interval ends into segments, each with the
+    features covering it, so a query is one bisect.
+    """
+    def __init__(self, bed_file):
+        self.names, self.chroms, self.starts, self.ends = [], [], [], []
+        name_idx, intervals = {}, {}
+        fid = open(bed_file, "r")
+        for line in fid:
+            if (line.startswith("#") or line.startswith("track") or
+                line.startswith("browser") or line.strip() == ""):
+                continue
+            _val = line.rstrip("\n").split("\t")
+            if len(_val) < 3:
+                raise ValueError("need chrom, start and end in each line of "
+                                 "%s\n    -- %s" %(bed_file, line.rstrip()))
+            chrom, start, end = _val[0], int(_val[1]), int(_val[2])
+            name = _val[3] if len(_val) > 3 else "%s:%d-%d" %(chrom, start, end)
+            if name not in name_idx:
+                name_idx[name] = len(self.names)
+                self.names.append(name)
+                self.chroms.append(chrom)
+                self.starts.append(start)
+                self.ends.append(end)
+            k = name_idx[name]
+            self.starts[k] = min(self.starts[k], start)
+            self.ends[k] = max(self.ends[k], end)
+            intervals.setdefault(chrom, []).append((start, end, k))
+        fid.close()
+
+        # chrom -> (segment bounds, feature ids of each segment)
+        self.segments = {}
+        for chrom, _list in intervals.items():
+            bounds = sorted(set([x[0] for x in _list] + [x[1] for x in _list]))
+            members = [set() for x in range(len(bounds) - 1)]
+            for start, end, k in _list:
+                s = bisect_right(bounds, start) - 1
+                while s < len(members) and bounds[s] < end:
+                    members[s].add(k)
+                    s += 1
+            self.segments[chrom] = (bounds, [np.array(sorted(x), dtype=np.int64)
+                                             for x in members])
+
+    def __len__(self):
+        return len(self.names)
+
+    def query(self, chrom, pos0):
+        """Feature ids covering the 0-based pos0 of chrom.
+        """
+        if chrom not in self.segments:
+            chrom = ([x for x in chrom_aliases(chrom) if x in self.segments] +
+                     [None])[0]
+            if chrom is None:
+                return None
+        bounds, members = self.segments[chrom]
+        s = bisect_right(bounds, pos0) - 1
+        if s < 0 or s >= len(members) or len(members[s]) == 0:
+            return None
+        return members[s]
+
+
+class FeatureCounter(object):
+    """Sum the AD and DP of each cell over the output SNPs of each feature,
+    and save them sparse, as (feature, cell, AD, DP), into out_file (npz).
+    """
+    def __init__(self, index, out_file, max_nnz=FEATURE_CHUNK_NNZ):
+        self.index = index
+        self.out_file = out_file
+        self.max_nnz = max_nnz
+        self.n_cols = None
+        self.n_sites = np.zeros(len(index), dtype=np.int64)
+        self.keys, self.ad, self.dp = [], [], []
+        self.nnz = 0
+
+    def add(self, vcf_line, base_cells):
+        """Add an output SNP, with REF and ALT as chosen in its vcf line.
+        """
+        _val = vcf_line.split(b"\t", 5)
+        f_ids = self.index.query(_val[0].decode(), int(_val[1]) - 1)
+        if f_ids is None:
+            return
+        _cnt = np.asarray(base_cells, dtype=np.int64)
+        if self.n_cols is None:
+            self.n_cols = _cnt.shape[0]
+        _ad = _cnt[:, "ACGTN".index(_val[4].decode())]
+        _dp = _ad + _cnt[:, "ACGTN".index(_val[3].decode())]
+        _idx = np.flatnonzero(_dp > 0)
+        self.n_sites[f_ids] += 1
+        for k in f_ids:
+            self.keys.append(k * self.n_cols + _idx)
+            self.ad.append(_ad[_idx])
+            self.dp.append(_dp[_idx])
+        self.nnz += len(f_ids) * len(_idx)
+        if self.nnz >= self.max_nnz:
+            self._reduce()
+            # not reduced again until it doubles
+            self.max_nnz = max(self.max_nnz, 2 * self.nnz)
+
+    def _reduce(self):
+        if len(self.keys) == 0:
+            return
+        keys, ad, dp = sum_by_key(np.concatenate(self.keys),
+            np.concatenate(self.ad), np.concatenate(self.dp))
+        self.keys, self.ad, self.dp = [keys], [ad], [dp]
+        self.nnz = len(keys)
+
+    def close(self):
+        self._reduce()
+        n_cols = 1 if self.n_cols is None else self.n_cols
+        keys = self.keys[0] if self.nnz > 0 else np.zeros(0, dtype=np.int64)
+        np.savez_compressed(self.out_file, feature=keys // n_cols,
+            cell=keys % n_cols,
+            ad=self.ad[0] if self.nnz > 0 else np.zeros(0, dtype=np.int64),
+            dp=self.dp[0] if self.nnz > 0 else np.zeros(0, dtype=np.int64),
+            n_sites=self.n_sites)
+
+
+def sum_by_key(keys, ad, dp):
+    """Sum AD and DP of the same key, return sorted unique keys, AD and DP.
+    """
+    keys_uniq, _inv = np.unique(keys, return_inverse=True)
+    ad = np.bincount(_inv, weights=ad, minlength=len(keys_uniq))
+    dp = np.bincount(_inv, weights=dp, minlength=len(keys_uniq))
+    return keys_uniq, ad.astype(np.int64), dp.astype(np.int64)
+
+def merge_features(out_dir, index, feature_files, vcf_file):
+    """Sum the feature counts of all jobs, and write cellSNP.features.tsv and
+    the feature x sample matrices cellSNP.feature.AD.mtx and .DP.mtx into
+    out_dir, with the samples of the #CHROM line of vcf_file. Return the
+    number of features with SNPs.
+    """
+    with open(vcf_file, "r") as fid:
+        for line in fid:
+            if line.startswith("#CHROM"):
+                n_cols = len(line.rstrip("\n").split("\t")) - 9
+                break
+    n_sites = np.zeros(len(index), dtype=np.int64)
+    keys, ad, dp = [], [], []
+    for _file in feature_files:
+        if not os.path.isfile(_file):
+            continue
+        with np.load(_file) as dat:
+            keys.append(dat["feature"] * n_cols + dat["cell"])
+            ad.append(dat["ad"])
+            dp.append(dat["dp"])
+            n_sites += dat["n_sites"]
+        os.remove(_file)
+    if len(keys) > 0:
+        keys, ad, dp = sum_by_key(np.concatenate(keys), np.concatenate(ad),
+                                  np.concatenate(dp))
+    else:
+        keys = ad = dp = np.zeros(0, dtype=np.int64)
+
+    fid = open(os.path.join(out_dir, FEATURE_LIST), "w")
+    for k in range(len(index)):
+        fid.writelines("%s\t%s\t%d\t%d\t%d\n" %(index.names[k],
+            index.chroms[k], index.starts[k], index.ends[k], n_sites[k]))
+    fid.close()
+    rows, cols = keys // n_cols + 1, keys % n_cols + 1
+    for _tag, _dat in [("AD", ad), ("DP", dp)]:
+        fid = open(os.path.join(out_dir, "cellSNP.feature.%s.mtx" %_tag), "w")
+        fid.writelines("%" + "%MatrixMarket matrix coordinate integer general\n")
+        fid.writelines("%\n")
+        _nz = np.flatnonzero(_dat > 0)
+        fid.writelines("%d\t%d\t%d\n" %(len(index), n_cols, len(_nz)))
+        fid.writelines(["%d\t%d\t%d\n" %(rows[j], cols[j], _dat[j])
+                        for j in _nz])
+        fid.close()
+    return int(np.sum(n_sites > 0))
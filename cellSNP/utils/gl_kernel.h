@@ -0,0 +1,102 @@
+/* Genotype likelihoods of many cells at a site, or of the cells of many sites
+ * with their bases reordered (see geno_sites), see qual_matrix_to_geno in
+ * pileup_utils.pyx for the model.
+ * Date: 17/10/2026
+ *
+ * The inputs are structure-of-arrays over the cells, so the loops over cells
+ * are vectorised by the compiler. On x86-64 Linux with GCC >= 6 or clang >= 14,
+ * the kernel is compiled for AVX-512, AVX2, SSE4.2 and baseline x86-64, and
+ * the variant for the CPU is chosen at load time (ifunc).
+ */
+
+#ifndef CELLSNP_GL_KERNEL_H
+#define CELLSNP_GL_KERNEL_H
+
+#include <math.h>
+
+#if defined(__x86_64__) && defined(__linux__) && \
+    ((defined(__clang__) && __clang_major__ >= 14) || \
+     (!defined(__clang__) && defined(__GNUC__) && __GNUC__ >= 6))
+#define GL_TARGET_CLONES \
+    __attribute__((target_clones("avx512f", "avx2", "sse4.2", "default")))
+#else
+#define GL_TARGET_CLONES
+#endif
+
+/* No FMA contraction of a * b + c, which rounds once instead of twice, so the
+ * GLs (and PL on ties) are the same in all clones and as qual_matrix_to_geno.
+ */
+#if !defined(__clang__) && defined(__GNUC__)
+#define GL_VECTORIZE \
+    __attribute__((optimize("tree-vectorize", "fp-contract=off")))
+#else
+#define GL_VECTORIZE
+#endif
+
+#if defined(__clang__)
+#pragma STDC FP_CONTRACT OFF
+#endif
+
+/*
+ * @abstract    GT and PL of n cells with the same REF and ALT.
+ * @param n     Number of cells.
+ * @param qual  Quality sums, qual[(b * 4 + k) * n + i] for base b (ACGTN) and
+ *              term k ([1-Q, 3/4-2/3Q, 1/2-1/3Q, Q], see qual_vector) of cell i.
+ * @param cnt   Base counts, cnt[b * n + i].
+ * @param ref   Index of REF in ACGTN.
+ * @param alt   Index of ALT in ACGTN.
+ * @param n_gl  3 for GL1-GL3, or 5 with the doublet GL4 and GL5.
+ * @param work  Scratch of 2 * n doubles.
+ * @param gt    Output, index of 0/0, 1/0, 1/1 with the largest of GL1-GL3.
+ * @param pl    Output, Phred-scaled GLs rounded to nearest (even on ties, as
+ *              "%.0f"), pl[g * n + i].
+ */
+GL_TARGET_CLONES GL_VECTORIZE
+void cellsnp_gl_batch(int n, const double *qual, const double *cnt, int ref,
+                      int alt, int n_gl, double *work, int *gt, int *pl)
+{
+    const double L23 = log(2.0 / 3), L13 = log(1.0 / 3), L14 = log(1.0 / 4);
+    const double LN10 = log(10);
+    const double *rq = qual + ref * 4 * n, *aq = qual + alt * 4 * n;
+    const double *rc = cnt + ref * n, *ac = cnt + alt * n;
+    double *oq = work, *oc = work + n;
+    int i, b;
+
+    /* quality and count of the other bases */
+    for (i = 0; i < n; i++) {
+        oq[i] = 0;
+        oc[i] = 0;
+    }
+    for (b = 0; b < 5; b++) {
+        const double *bq = qual + (b * 4 + 3) * n, *bc = cnt + b * n;
+        if (b == ref || b == alt)
+            continue;
+        for (i = 0; i < n; i++) {
+            oq[i] += bq[i];
+            oc[i] += bc[i];
+        }
+    }
+
+    for (i = 0; i < n; i++) {
+        double oth = oq[i] + L23 * oc[i];
+        double gl1 = oth + rq[i] + aq[3 * n + i] + L13 * ac[i];
+        double gl2 = oth + rq[2 * n + i] + aq[2 * n + i];
+        double gl3 = oth + rq[3 * n + i] + aq[i] + L13 * rc[i];
+        /* the first of the largest, as np.argmax */
+        gt[i] = gl1 >= gl2 ? (gl1 >= gl3 ? 0 : 2) : (gl2 >= gl3 ? 1 : 2);
+        pl[i] = (int)nearbyint(-10 * gl1 / LN10);
+        pl[n + i] = (int)nearbyint(-10 * gl2 / LN10);
+        pl[2 * n + i] = (int)nearbyint(-10 * gl3 / LN10);
+    }
+    if (n_gl < 5)
+        return;
+    for (i = 0; i < n; i++) {
+        double oth = oq[i] + L23 * oc[i];
+        double gl4 = oth + rq[n + i] + L14 * ac[i];
+        double gl5 = oth + aq[n + i] + L14 * rc[i];
+        pl[3 * n + i] = (int)nearbyint(-10 * gl4 / LN10);
+        pl[4 * n + i] = (int)nearbyint(-10 * gl5 / LN10);
+    }
+}
+
+#endif
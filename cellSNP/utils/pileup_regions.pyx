@@ -3,9 +3,14 @@
 # Author: Yuanhua Huang
 # Date: 21/05/2018
 
+import heapq
 from .pileup_utils import *
 from .pileup_utils cimport *
-from .cellsnp_utils cimport get_query_bases, get_query_qualities
+from .raw_utils import RawWriter
+from pysam.libcalignedsegment cimport AlignedSegment
+from .cellsnp_utils cimport query_offset, ReadKernel
+from .stats_utils cimport RunStats, get_stats, STAGE_SEEK, STAGE_INFLATE, \
+    STAGE_DECODE, STAGE_FILTER, REJ_DEL_SKIP
 
 ## ealier high error in pileup whole genome might come from
 ## using _read.query_sequence, which has only partially aligned
@@ -39,92 +44,272 @@ from .cellsnp_utils cimport get_query_bases, get_query_qualities
 
 
 def pileup_bases(pileupColumn, real_POS, cell_tag, UMI_tag, min_MAPQ, 
-                 max_FLAG, min_LEN):
+                 max_FLAG, min_LEN, ReadKernel kernel=None):
     """ 
     Pileup all reads mapped to the genome position.
     Filtering is also applied, including cell and UMI tags and read mapping 
     quality.
+    kernel: the ReadKernel of the run for these options, created if None.
     """
     base_list, qual_list, UMIs_list, cell_list = [], [], [], []
+    cdef RunStats stats = get_stats()
+    cdef double t0
+    cdef AlignedSegment _read
+    cdef int idx, reason
+    if kernel is None:
+        kernel = ReadKernel(cell_tag, UMI_tag, min_MAPQ, max_FLAG, min_LEN)
+    RV = base_list, qual_list, UMIs_list, cell_list
     for pileupread in pileupColumn.pileups:
+        stats.n_reads += 1
         # query position is None if is_del or is_refskip is set.
         if pileupread.is_del or pileupread.is_refskip:
+            stats.rej[REJ_DEL_SKIP] += 1
             continue
             
+        t0 = stats.tic()
         _read = pileupread.alignment
         if real_POS is not None:
-            try:
-                idx = _read.positions.index(real_POS-1)
-            except:
+            idx = query_offset(_read._delegate, real_POS - 1)
+            if idx < 0:
+                stats.toc(STAGE_DECODE, t0)
+                stats.rej[REJ_DEL_SKIP] += 1
                 continue
-            _qual = get_query_qualities(_read, full_length = False)[idx]
-            _base = get_query_bases(_read, full_length = False)[idx].upper()
         else:
-            query_POS = pileupread.query_position
-            _qual = _read.query_qualities[query_POS - 1]
-            _base = _read.query_sequence[query_POS - 1].upper()
+            idx = pileupread.query_position - 1
+        stats.toc(STAGE_DECODE, t0)
 
-        ## filtering reads
-        if (_read.mapq < min_MAPQ or _read.flag > max_FLAG or 
-            len(_read.positions) < min_LEN): 
-            continue
-        if cell_tag is not None and _read.has_tag(cell_tag) == False: 
-            continue
-        if UMI_tag is not None and _read.has_tag(UMI_tag) == False: 
+        ## filtering reads, counting the reason of rejection
+        t0 = stats.tic()
+        reason = kernel.check(_read)
+        stats.toc(STAGE_FILTER, t0)
+        if reason >= 0:
+            stats.rej[reason] += 1
             continue
+        kernel.add(_read, idx, RV)
+    return RV
 
-        if UMI_tag is not None:
-            UMIs_list.append(fmt_umi_tag(_read, cell_tag, UMI_tag))
-        if cell_tag is not None:
-            cell_list.append(_read.get_tag(cell_tag))
-            
-        base_list.append(_base)
-        qual_list.append(_qual)
-    return base_list, qual_list, UMIs_list, cell_list
+
+def sync_pileup(samFile_list, chroms, regions=None):
+    """Iterate the pileup columns of multiple sam files in sync, like 
+    mpileup. Yield (0-based pos, list of columns), with None for the files 
+    without reads at pos. A column is only valid until the next iteration, 
+    as the iterator of its file is advanced after the column is used.
+    regions: sorted, non-overlapping 0-based (start, end) to pile up, each 
+    through the index, rather than the whole chrom.
+    """
+    if regions is None:
+        regions = [(None, None)]
+    for start, end in regions:
+        iters = [samFile_list[s].pileup(contig=chroms[s], start=start, 
+                                        stop=end, truncate=start is not None) 
+                 if chroms[s] is not None else iter([]) 
+                 for s in range(len(samFile_list))]
+        heap = []
+        for s in range(len(iters)):
+            _column = next(iters[s], None)
+            if _column is not None:
+                heapq.heappush(heap, (_column.pos, s, _column))
+        while len(heap) > 0:
+            pos = heap[0][0]
+            columns = [None] * len(iters)
+            while len(heap) > 0 and heap[0][0] == pos:
+                _pos, s, _column = heapq.heappop(heap)
+                columns[s] = _column
+            yield pos, columns
+            for s in range(len(iters)):
+                if columns[s] is not None:
+                    _column = next(iters[s], None)
+                    if _column is not None:
+                        heapq.heappush(heap, (_column.pos, s, _column))
+
+
+def load_bed_regions(bed_file):
+    """Load the regions of a BED file (0-based start, end), sorted and 
+    merged if overlapping or adjacent. Return the chroms in the order of the
+    file, and a dict of chrom -> list of (start, end).
+    """
+    chroms, regions = [], {}
+    fid = open(bed_file, "r")
+    for line in fid:
+        if (line.startswith("#") or line.startswith("track") or
+            line.startswith("browser") or line.strip() == ""):
+            continue
+        _val = line.rstrip("\n").split("\t")
+        if len(_val) < 3:
+            raise ValueError("need chrom, start and end in each line of %s"
+                             "\n    -- %s" %(bed_file, line.rstrip()))
+        if _val[0] not in regions:
+            chroms.append(_val[0])
+            regions[_val[0]] = []
+        if int(_val[2]) > int(_val[1]):
+            regions[_val[0]].append((int(_val[1]), int(_val[2])))
+    fid.close()
+    for _chrom in chroms:
+        _merged = []
+        for start, end in sorted(regions[_chrom]):
+            if len(_merged) > 0 and start <= _merged[-1][1]:
+                _merged[-1] = (_merged[-1][0], max(_merged[-1][1], end))
+            else:
+                _merged.append((start, end))
+        regions[_chrom] = _merged
+    return chroms, regions
 
 
 def pileup_regions(samFile, barcodes, out_file=None, chrom=None, cell_tag="CR", 
                    UMI_tag="UR", min_COUNT=20, min_MAF=0.1, min_MAPQ=20, 
-                   max_FLAG=255, min_LEN=30, doublet_GL=False, verbose=True):
+                   max_FLAG=255, min_LEN=30, doublet_GL=False, verbose=True,
+                   max_mem=None, sample_ids=None, io_threads=0, 
+                   barcode_affix=None, no_GL=False, raw_prefix=None, 
+                   groups=None, features=None, regions=None):
     """Pileup allelic specific expression for a whole chromosome in sam file.
-    TODO: 1) multiple sam files, e.g., bulk samples; 2) optional cell barcode
+    samFile: one sam file, or a list of sam files which are piled up in one 
+    pass (see sync_pileup); bulk files are output as sample_ids, and the reads
+    of single-cell files are counted together, with barcode_affix giving the 
+    (prefix, suffix) added to the cell barcodes of each file.
+    max_mem: memory budget (bytes) of this worker, bounded by a hotspot slot
+    held while the reads of a deep column are decoded and mapped; beyond it,
+    the vcf lines returned without out_file and the raw counts kept in 
+    memory are moved to disk (see SpillList).
+    io_threads: decompression threads of each sam file.
+    no_GL: only output the counts, without reading base qualities.
+    raw_prefix: if given, save the per-cell counts of the sites passing 
+    min_COUNT into npz chunks with this prefix (see RawWriter).
+    groups: (group names, group index of each barcode), to output one column
+    per group of cells rather than per cell (see map_barcodes).
+    features: a FeatureCounter summing the AD and DP of the output SNPs over
+    the features (e.g., genes) they overlap.
+    regions: sorted, non-overlapping 0-based (start, end) of chrom to pile 
+    up, rather than the whole chromosome (see load_bed_regions).
     """
-    samFile, chrom = check_pysam_chrom(samFile, chrom)
+    samFile_list = list(samFile) if type(samFile) == list else [samFile]
+    chroms = []
+    for s in range(len(samFile_list)):
+        samFile_list[s], _chrom = check_pysam_chrom(samFile_list[s], chrom, 
+                                                    io_threads)
+        chroms.append(_chrom)
+    # the first file having chrom, for its name and length
+    s = ([x for x in range(len(chroms)) if chroms[x] is not None] + [0])[0]
+    samFile, chrom = samFile_list[s], chroms[s]
+    if sample_ids is None:
+        sample_ids = ["sample%d" %x for x in range(len(samFile_list))]
     if out_file is not None:
-        fid = open(out_file, "w")
-        fid.writelines(VCF_HEADER + CONTIG)
-        if barcodes is not None:
-            fid.writelines("\t".join(VCF_COLUMN + barcodes) + "\n")
+        # binary, as get_vcf_line returns bytes
+        fid = open(out_file, "wb")
+        fid.write((get_vcf_header(no_GL) + 
+                   get_contig_map(samFile).vcf_header()).encode())
+        if groups is not None:
+            fid.write(("\t".join(VCF_COLUMN + groups[0]) + "\n").encode())
+        elif barcodes is not None:
+            fid.write(("\t".join(VCF_COLUMN + barcodes) + "\n").encode())
         else:
-            fid.writelines("\t".join(VCF_COLUMN + ["sample0"]) + "\n")
+            fid.write(("\t".join(VCF_COLUMN + sample_ids) + "\n").encode())
     
     POS_CNT = 0
     vcf_lines_all = []
-    for pileupcolumn in samFile.pileup(contig=chrom):
+    if out_file is None and max_mem is not None:
+        vcf_lines_all = SpillList(max_mem // 4, raw_prefix)
+    sites = SiteBatch(vcf_lines_all.append if out_file is None else fid.write,
+                      min_COUNT, min_MAF, doublet_GL, no_GL, features)
+    cdef RunStats stats = get_stats()
+    stats.set_chrom(chrom)
+    # the per-read kernel for the tags used, chosen once for the run
+    kernel = ReadKernel(cell_tag, UMI_tag, min_MAPQ, max_FLAG, min_LEN, 
+                        not no_GL)
+    raw = None if raw_prefix is None else RawWriter(raw_prefix)
+    # progress in bp of the regions: the region of pos, and bp before it
+    cdef long r_idx = 0, r_done = 0
+    cdef double t0 = stats.tic()
+    column_iter = sync_pileup(samFile_list, chroms, regions)
+    stats.toc(STAGE_SEEK, t0)
+    t0 = stats.tic()
+    for pos, columns in column_iter:
+        stats.toc(STAGE_INFLATE, t0)
         POS_CNT += 1
+        stats.n_sites += 1
+        if regions is None:
+            stats.n_units = pos + 1
+        else:
+            while r_idx < len(regions) - 1 and pos >= regions[r_idx][1]:
+                r_done += regions[r_idx][1] - regions[r_idx][0]
+                r_idx += 1
+            stats.n_units = r_done + pos - regions[r_idx][0] + 1
+        if POS_CNT % 10000 == 0:
+            stats.push_progress()
+            if over_budget(max_mem):
+                sites.flush()
+                spill_mem(vcf_lines_all, raw)
         if verbose and POS_CNT % 1000000 == 0:
             print("%s: %dM positions processed." %(chrom, POS_CNT/1000000))
-        if pileupcolumn.n < min_COUNT:
+        n_reads = sum([x.n for x in columns if x is not None])
+        if n_reads < min_COUNT:
+            t0 = stats.tic()
             continue
 
-        base_list, qual_list, UMIs_list, cell_list = pileup_bases(pileupcolumn, 
-            pileupcolumn.pos + 1, cell_tag, UMI_tag, min_MAPQ, max_FLAG, min_LEN)
-        
-        if len(base_list) < min_COUNT:
-            continue
-        base_merge, base_cells, qual_cells = map_barcodes(base_list, qual_list, 
-            cell_list, UMIs_list, barcodes)
+        # hold a hotspot slot while the reads of a deep column are in memory
+        is_hot = hot_enter(n_reads)
+        if len(columns) == 1 or barcodes is not None:
+            base_list, qual_list, UMIs_list, cell_list = [], [], [], []
+            for s in range(len(columns)):
+                if columns[s] is None:
+                    continue
+                _bases = pileup_bases(columns[s], pos + 1, cell_tag, UMI_tag, 
+                                      min_MAPQ, max_FLAG, min_LEN, kernel)
+                _cells, _UMIs = _bases[3], _bases[2]
+                if barcode_affix is not None:
+                    _cells, _UMIs = add_barcode_affix(_cells, _UMIs, 
+                                                      barcode_affix[s])
+                base_list += _bases[0]
+                qual_list += _bases[1]
+                UMIs_list += _UMIs
+                cell_list += _cells
+            if len(base_list) < min_COUNT:
+                hot_exit(is_hot)
+                t0 = stats.tic()
+                continue
+            base_merge, base_cells, qual_cells = map_barcodes(base_list, 
+                qual_list, cell_list, UMIs_list, barcodes, no_GL, groups)
+            # minCOUNT on the UMIs of the barcodes, as the multiple samples
+            if sum(base_merge.values()) < min_COUNT:
+                hot_exit(is_hot)
+                t0 = stats.tic()
+                continue
+        else:
+            ### for multiple samples, as fetch_positions
+            base_merge = BASE_ZERO.copy()
+            base_cells, qual_cells = [], []
+            for _column in columns:
+                if _column is None:
+                    _bases = [], [], [], []
+                else:
+                    _bases = pileup_bases(_column, pos + 1, cell_tag, UMI_tag, 
+                                          min_MAPQ, max_FLAG, min_LEN, kernel)
+                _merge, _cells, _quals = map_barcodes(_bases[0], _bases[1], 
+                    _bases[3], _bases[2], None, no_GL)
+                for _key in base_merge.keys():
+                    base_merge[_key] += _merge[_key]
+                base_cells.append(_cells[0])
+                if not no_GL:
+                    qual_cells.append(_quals[0])
+            if sum(base_merge.values()) < min_COUNT:
+                hot_exit(is_hot)
+                t0 = stats.tic()
+                continue
         
-        vcf_line = get_vcf_line(base_merge, base_cells, qual_cells,
-            pileupcolumn.reference_name, pileupcolumn.pos + 1, min_COUNT, min_MAF,
-            REF = None, ALT = None, doublet_GL = doublet_GL)
-
-        if vcf_line is not None:
-            if out_file is None:
-                vcf_lines_all.append(vcf_line)
-            else:
-                fid.writelines(vcf_line)
+        if raw is not None:
+            raw.add(chrom, pos + 1, None, None, base_cells, qual_cells)
+        sites.add(base_merge, base_cells, qual_cells, chrom, pos + 1)
+        hot_exit(is_hot)
+        t0 = stats.tic()
+    if regions is not None:
+        stats.n_units = sum([x[1] - x[0] for x in regions])
+    elif chrom is not None:
+        stats.n_units = samFile.get_reference_length(chrom)
     
+    sites.flush()
+    if raw is not None:
+        raw.close()
+    if features is not None:
+        features.close()
     if out_file is not None:
         fid.close() 
     return vcf_lines_all
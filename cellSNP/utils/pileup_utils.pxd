@@ -1,3 +1,5 @@
 
 cdef qual_vector(qual=*, double capBQ=*, double minBQ=*)
-cdef qual_matrix_to_geno(qual_matrix, base_count, REF, ALT, bint doublet_GL=*)
\ No newline at end of file
+cdef qual_matrix_to_geno(qual_matrix, base_count, REF, ALT, bint doublet_GL=*)
+cdef geno_batch(qual_cells, base_cells, REF, ALT, bint doublet_GL=*)
+cdef geno_sites(sites, bint doublet_GL=*)
\ No newline at end of file
@@ -12,9 +12,22 @@ import sys
 import pysam
 import numpy as np
 cimport libc.math as c_math
-from .base_utils import id_mapping, unique_list
+from cpython.bytes cimport PyBytes_FromStringAndSize
+from .base_utils import unique_list
+from .schedule_utils import hot_active, hot_enter, hot_exit, over_budget, \
+    SpillList
+from .raw_utils import RawWriter
+from .contig_utils import ContigMap
+from .sweep_utils import contig_depths, plan_windows, write_windows, sweep_bases
 from ..version import __version__
-from .cellsnp_utils cimport get_query_bases, get_query_qualities, c_max, c_min
+from pysam.libcalignedsegment cimport AlignedSegment
+from .cellsnp_utils cimport c_max, c_min
+from .cellsnp_utils cimport query_offset
+from .cellsnp_utils cimport ReadKernel, tag_bytes, tag_value
+from .stats_utils cimport RunStats, get_stats, STAGE_SEEK, STAGE_INFLATE, \
+    STAGE_DECODE, STAGE_FILTER, STAGE_UMI, STAGE_BARCODE, STAGE_GL, \
+    STAGE_FORMAT, STAGE_WRITE, REJ_DEL_SKIP, REJ_MAPQ, REJ_FLAG, REJ_LEN, \
+    REJ_NO_CELL, REJ_NO_UMI, REJ_BARCODE
 
 VCF_HEADER = (
     '##fileformat=VCFv4.2\n'
@@ -38,6 +51,19 @@ VCF_HEADER = (
     'bases in order of A,C,G,T,N">\n' %__version__)
 #'##FORMAT=<ID=GL,Number=G,Type=String,Description="Genotype likelihood">\n'
 
+# the FORMAT lines of GT and PL, left out of the header with noGL
+GL_FORMAT = (
+    '##FORMAT=<ID=GT,Number=1,Type=String,Description="Genotype">\n'
+    '##FORMAT=<ID=PL,Number=G,Type=Integer,Description="List of Phred-scaled '
+    'genotype likelihoods">\n')
+
+def get_vcf_header(no_GL=False):
+    """The VCF header lines before the contigs; without the GT and PL FORMAT
+    lines if no_GL, as the lines have no GT and PL (see get_vcf_line).
+    """
+    return VCF_HEADER.replace(GL_FORMAT, "") if no_GL else VCF_HEADER
+
+# contig lines without a sam header, otherwise see ContigMap.vcf_header
 CONTIG = "".join(['##contig=<ID=%s>\n' %x for x in list(range(1,23))+['X', 'Y']])
 header_line="#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\tFORMAT"
 
@@ -47,12 +73,101 @@ VCF_COLUMN = ["#CHROM", "POS", "ID", "REF", "ALT", "QUAL", "FILTER",
 BASE_IDX = {"A": 0, "C": 1, "G": 2, "T": 3, "N": 4}
 BASE_ZERO = {"A": 0, "C": 0, "G": 0, "T": 0, "N": 0}
 
+## sites whose GT and PL are computed by one kernel call (see SiteBatch): at 
+## most GENO_SITES sites, or GENO_CELLS cell columns of the sites held
+GENO_SITES = 64
+GENO_CELLS = 100000
+
 global CACHE_CHROM
 global CACHE_SAMFILE
 CACHE_CHROM = None
 CACHE_SAMFILE = None
 
-def check_pysam_chrom(samFile, chrom=None):
+## sam file name -> ContigMap of its header, built once per process
+global CONTIG_MAPS
+CONTIG_MAPS = {}
+
+## bits of htslib's CRAM_OPT_REQUIRED_FIELDS
+SAM_QNAME, SAM_FLAG, SAM_RNAME, SAM_POS, SAM_MAPQ = 0x1, 0x2, 0x4, 0x8, 0x10
+SAM_CIGAR, SAM_RNEXT, SAM_PNEXT, SAM_TLEN = 0x20, 0x40, 0x80, 0x100
+SAM_SEQ, SAM_QUAL, SAM_AUX, SAM_RGAUX = 0x200, 0x400, 0x800, 0x1000
+
+## reference fasta and decoded fields for opening cram files
+global CRAM_OPTIONS
+CRAM_OPTIONS = (None, None)
+
+def set_cram_options(ref_file=None, tags=None, mates=False, quals=True):
+    """Set the reference fasta, and only decode the fields used by cellSNP
+    from cram files: FLAG, position, MAPQ, CIGAR, sequence, qualities (unless 
+    quals is False, i.e., without GL), and aux tags if cell or UMI tags are 
+    used (htslib decodes all aux tags or none, except RG alone). mates keeps 
+    read names and mate positions, which pileup uses to detect overlapping 
+    read pairs.
+    Return the options, for initializing subprocesses.
+    """
+    global CRAM_OPTIONS
+    fields = SAM_FLAG | SAM_RNAME | SAM_POS | SAM_MAPQ | SAM_CIGAR | SAM_SEQ
+    if quals:
+        fields |= SAM_QUAL
+    tags = [] if tags is None else [x for x in tags if x is not None]
+    if tags == ["RG"]:
+        fields |= SAM_RGAUX
+    elif len(tags) > 0:
+        fields |= SAM_AUX
+    if mates:
+        fields |= SAM_QNAME | SAM_RNEXT | SAM_PNEXT | SAM_TLEN
+    CRAM_OPTIONS = (ref_file, fields)
+    return CRAM_OPTIONS
+
+def init_cram_options(cram_options):
+    global CRAM_OPTIONS
+    CRAM_OPTIONS = cram_options
+
+def open_sam(sam_file, threads=0):
+    """Open a sam/bam/cram file by its suffix, with threads for decompression.
+    "-" is stdin, in any of the formats. Cram files are opened with 
+    CRAM_OPTIONS, and htslib keeps the reference of the current contig in 
+    memory, so reusing the opened file (as check_pysam_chrom and the chrom 
+    caches do) avoids loading the reference again on each seek.
+    """
+    ref_file, fields = CRAM_OPTIONS
+    cram_opts = ["decode_md=0"]
+    if fields is not None:
+        cram_opts.append("required_fields=0x%x" %fields)
+    if sam_file == "-":
+        # cram options are ignored by htslib if the stream is not cram
+        return pysam.AlignmentFile(sam_file, "r", threads=threads, 
+            reference_filename=ref_file, format_options=cram_opts)
+    ftype = sam_file.split(".")[-1]
+    if ftype != "bam" and ftype != "sam" and ftype != "cram" :
+        print("Error: file type need suffix of bam, sam or cram.")
+        sys.exit(1)
+    if ftype == "cram":
+        return pysam.AlignmentFile(sam_file, "rc", threads=threads, 
+            reference_filename=ref_file, format_options=cram_opts)
+    elif ftype == "bam":
+        return pysam.AlignmentFile(sam_file, "rb", threads=threads)
+    else:
+        return pysam.AlignmentFile(sam_file, "r")
+
+def get_read_groups(sam_files):
+    """Sorted IDs of all read groups (@RG) in the headers of the sam files.
+    """
+    RG_ids = set()
+    for sam_file in sam_files:
+        samFile = open_sam(sam_file)
+        RG_ids.update([x["ID"] for x in samFile.header.to_dict().get("RG", [])])
+        samFile.close()
+    return sorted(RG_ids)
+
+def get_contig_map(samFile):
+    """ContigMap of an opened sam file, built once for each file name.
+    """
+    if samFile.filename not in CONTIG_MAPS:
+        CONTIG_MAPS[samFile.filename] = ContigMap.from_sam(samFile)
+    return CONTIG_MAPS[samFile.filename]
+
+def check_pysam_chrom(samFile, chrom=None, threads=0):
     """Chech if samFile is a file name or pysam object, and if chrom format. 
     """
     global CACHE_CHROM
@@ -63,26 +178,15 @@ def check_pysam_chrom(samFile, chrom=None):
             return CACHE_SAMFILE, CACHE_CHROM
 
     if type(samFile) == str:
-        ftype = samFile.split(".")[-1]
-        if ftype != "bam" and ftype != "sam" and ftype != "cram" :
-            print("Error: file type need suffix of bam, sam or cram.")
-            sys.exit(1)
-        if ftype == "cram":
-            samFile = pysam.AlignmentFile(samFile, "rc")
-        elif ftype == "bam":
-            samFile = pysam.AlignmentFile(samFile, "rb")
-        else:
-            samFile = pysam.AlignmentFile(samFile, "r")
+        samFile = open_sam(samFile, threads)
 
     if chrom is not None:
-        if chrom not in samFile.references:
-            if chrom.startswith("chr"):
-                chrom = chrom.split("chr")[1]
-            else:
-                chrom = "chr" + chrom
-        if chrom not in samFile.references:
+        # the name in the header, with or without the chr prefix
+        _chrom = get_contig_map(samFile).resolve(chrom)
+        if _chrom is None:
             print("Can't find references %s in samFile" %chrom)
             return samFile, None
+        chrom = _chrom
     
     CACHE_CHROM = chrom
     CACHE_SAMFILE = samFile
@@ -147,6 +251,103 @@ cdef qual_matrix_to_geno(qual_matrix, base_count, REF, ALT, bint doublet_GL=Fals
 
     return GT_out, PL_out
 
+cdef extern from "gl_kernel.h":
+    void cellsnp_gl_batch(int n, const double *qual, const double *cnt, int ref,
+                          int alt, int n_gl, double *work, int *gt, 
+                          int *pl) nogil
+
+cdef geno_batch(qual_cells, base_cells, REF, ALT, bint doublet_GL=False):
+    """
+    GT and PL of many cells at once, as qual_matrix_to_geno for each cell, 
+    with the SIMD kernel in gl_kernel.h.
+    qual_cells: (n, 5, 4) quality matrices; base_cells: (n, 5) base counts
+    
+    return GT index (n,) of 0/0, 1/0, 1/1, and PL (3, n), or (5, n) with
+    doublet_GL, i.e., the cells are contiguous as the kernel writes them
+    """
+    cdef int n = len(base_cells)
+    cdef int n_gl = 5 if doublet_GL else 3
+    cdef int ref_idx = BASE_IDX[REF]
+    cdef int alt_idx = BASE_IDX[ALT]
+    gt = np.zeros(n, dtype=np.intc)
+    pl = np.zeros((n_gl, n), dtype=np.intc)
+    if n == 0:
+        return gt, pl
+    # structure of arrays, i.e., each of the 5x4 qualities over the cells
+    cdef double[:, :, ::1] _qual = np.ascontiguousarray(
+        np.transpose(np.asarray(qual_cells, dtype=np.float64), (1, 2, 0)))
+    cdef double[:, ::1] _cnt = np.ascontiguousarray(
+        np.asarray(base_cells, dtype=np.float64).T)
+    cdef double[::1] _work = np.empty(2 * n)
+    cdef int[::1] _gt = gt
+    cdef int[:, ::1] _pl = pl
+    with nogil:
+        cellsnp_gl_batch(n, &_qual[0, 0, 0], &_cnt[0, 0], ref_idx, alt_idx, 
+                         n_gl, &_work[0], &_gt[0], &_pl[0, 0])
+    return gt, pl
+
+cdef geno_sites(sites, bint doublet_GL=False):
+    """
+    GT and PL of the cells of many sites in one kernel call, as geno_batch 
+    for each site. The bases of each site are reordered as REF, ALT and the
+    other bases in ACGTN order, so all cells share REF and ALT, and the 
+    other bases are summed in the same order as for the site alone.
+    sites: list of (qual_cells, base_cells, REF, ALT), the cells as in
+    geno_batch
+    
+    return a list of (GT index, PL) of each site, as geno_batch
+    """
+    if len(sites) == 0:
+        return []
+    quals, cnts, bounds = [], [], [0]
+    for _qual, _cnt, REF, ALT in sites:
+        ref_idx, alt_idx = BASE_IDX[REF], BASE_IDX[ALT]
+        _order = [ref_idx, alt_idx] + [b for b in range(5) 
+                                       if b != ref_idx and b != alt_idx]
+        quals.append(np.asarray(_qual, dtype=np.float64).reshape(-1, 5, 4)
+                     [:, _order])
+        cnts.append(np.asarray(_cnt, dtype=np.float64).reshape(-1, 5)
+                    [:, _order])
+        bounds.append(bounds[-1] + len(cnts[-1]))
+    gt, pl = geno_batch(np.concatenate(quals), np.concatenate(cnts), "A", "C",
+                        doublet_GL)
+    return [(gt[bounds[k] : bounds[k + 1]], 
+             np.ascontiguousarray(pl[:, bounds[k] : bounds[k + 1]]))
+            for k in range(len(sites))]
+
+cdef extern from "vcf_format.h":
+    ctypedef struct vcf_buf_t:
+        size_t l, m
+        char *s
+    int vcf_put_mem(vcf_buf_t *b, const char *s, size_t n)
+    int vcf_put_int(vcf_buf_t *b, long x)
+    int vcf_put_cells(vcf_buf_t *b, int n, const int *cnt, int ref, int alt, 
+                      int n_obs, const int *gt, const int *pl, int n_gl)
+
+# the line buffer of this process, reused for all vcf lines
+cdef vcf_buf_t VCF_BUF
+
+cdef int _put_str(s) except -1:
+    cdef bytes _s = s.encode() if isinstance(s, str) else s
+    if vcf_put_mem(&VCF_BUF, _s, len(_s)) < 0:
+        raise MemoryError()
+    return 0
+
+cdef int _put_int(long x) except -1:
+    if vcf_put_int(&VCF_BUF, x) < 0:
+        raise MemoryError()
+    return 0
+
+cdef int _put_mem(const char *s, size_t n) except -1:
+    if vcf_put_mem(&VCF_BUF, s, n) < 0:
+        raise MemoryError()
+    return 0
+
+cdef const char *VCF_BASES = "ACGTN"
+
+# chrom name -> bytes, encoded once per process rather than for each line
+CHROM_BYTES = {}
+
 def fmt_umi_tag(read, cell_tag, umi_tag):
     """
     @abstract        Return formatted UMI string according to cell_tag and umi_tag.
@@ -159,10 +360,11 @@ def fmt_umi_tag(read, cell_tag, umi_tag):
 
 
 def fetch_bases(samFile, chrom, POS, cell_tag="CR", UMI_tag="UR", min_MAPQ=20, 
-                max_FLAG=255, min_LEN=30):
+                max_FLAG=255, min_LEN=30, ReadKernel kernel=None):
     """ Fetch bases from all reads mapped to a given genome position.
     Filtering is also applied, including cell and UMI tags and read mapping 
     quality.
+    kernel: the ReadKernel of the run for these options, created if None.
     """
     base_list, qual_list, UMIs_list, cell_list = [], [], [], []
     if samFile is None or chrom is None or POS is None:
@@ -177,30 +379,59 @@ def fetch_bases(samFile, chrom, POS, cell_tag="CR", UMI_tag="UR", min_MAPQ=20,
     if type(POS) != int:
         POS = int(POS)
 
-    for _read in samFile.fetch(chrom, POS-1, POS):
-        try:
-            idx = _read.positions.index(POS-1)
-        except:
-            continue
-
-        ## filtering reads
-        if (_read.mapq < min_MAPQ or _read.flag > max_FLAG or 
-            len(_read.positions) < min_LEN): 
-            continue
-        if cell_tag is not None and _read.has_tag(cell_tag) == False: 
-            continue
-        if UMI_tag is not None and _read.has_tag(UMI_tag) == False: 
-            continue
+    cdef RunStats stats = get_stats()
+    cdef double t0 = stats.tic()
+    read_iter = samFile.fetch(chrom, POS-1, POS)
+    stats.toc(STAGE_SEEK, t0)
+
+    if kernel is None:
+        kernel = ReadKernel(cell_tag, UMI_tag, min_MAPQ, max_FLAG, min_LEN)
+    cdef AlignedSegment _read
+    cdef int idx, reason
+    cdef long pos0 = POS - 1
+    RV = base_list, qual_list, UMIs_list, cell_list
+    t0 = stats.tic()
+    for _read in read_iter:
+        stats.toc(STAGE_INFLATE, t0)
+        stats.n_reads += 1
+        t0 = stats.tic()
+        idx = query_offset(_read._delegate, pos0)
+        stats.toc(STAGE_DECODE, t0)
+
+        ## filtering reads, counting the reason of rejection
+        t0 = stats.tic()
+        if idx < 0:
+            reason = REJ_DEL_SKIP
+        else:
+            reason = kernel.check(_read)
+        if reason >= 0:
+            stats.rej[reason] += 1
+        stats.toc(STAGE_FILTER, t0)
+
+        if reason < 0:
+            t0 = stats.tic()
+            kernel.add(_read, idx, RV)
+            stats.toc(STAGE_DECODE, t0)
+        t0 = stats.tic()
+    return RV
 
-        if UMI_tag is not None:
-            UMIs_list.append(fmt_umi_tag(_read, cell_tag, UMI_tag))
-        if cell_tag is not None:
-            cell_list.append(_read.get_tag(cell_tag))
 
-        _base = get_query_bases(_read, full_length = False)[idx].upper()
-        base_list.append(_base)
-        qual_list.append(get_query_qualities(_read, full_length = False)[idx])
-    return base_list, qual_list, UMIs_list, cell_list
+def add_barcode_affix(cell_list, UMIs_list, affix):
+    """Add the (prefix, suffix) of a sam file to its cell barcodes, also in
+    the UMI keys (cell>UMI), all bytes, so UMIs are grouped within the cells
+    of each file, and the same barcode in two files with different affixes 
+    are two cells.
+    """
+    prefix, suffix = affix
+    if prefix == "" and suffix == "":
+        return cell_list, UMIs_list
+    _prefix, _suffix = prefix.encode(), suffix.encode()
+    new_cells = [_prefix + x + _suffix for x in cell_list]
+    if len(UMIs_list) == len(cell_list):
+        UMIs_list = [_prefix + UMIs_list[k][:len(cell_list[k])] + _suffix + 
+                     UMIs_list[k][len(cell_list[k]):] 
+                     for k in range(len(cell_list))]
+    return new_cells, UMIs_list
 
 
 def filter_reads(read_list, cell_tag="CR", UMI_tag="UR", min_MAPQ=20, 
@@ -208,20 +439,20 @@ def filter_reads(read_list, cell_tag="CR", UMI_tag="UR", min_MAPQ=20,
     """Filter reads and check read tag, e.g., cell and UMI barcodes.
     """
     idx_keep, UMIs_list, cell_list = [], [], []
+    cdef ReadKernel kernel = ReadKernel(cell_tag, None, min_MAPQ, max_FLAG, 
+                                        min_LEN)
+    cdef bytes _utag = tag_bytes(UMI_tag)
     for i in range(len(read_list)):
-        _read = read_list[i]
-        if (_read.mapq < min_MAPQ or _read.flag > max_FLAG or 
-            len(_read.positions) < min_LEN): 
-            continue
-        if cell_tag is not None and _read.has_tag(cell_tag) == False: 
-            continue
-        if UMI_tag is not None and _read.has_tag(UMI_tag) == False: 
+        # the UMI without cell barcode, as before
+        if kernel.check(read_list[i]) >= 0:
             continue
         if UMI_tag is not None:
-            #UMIs_list.append(fmt_umi_tag(_read, cell_tag, UMI_tag))
-            UMIs_list.append(_read.get_tag(UMI_tag))
+            _UMI = tag_value(read_list[i], _utag)
+            if _UMI is None:
+                continue
+            UMIs_list.append(_UMI)
         if cell_tag is not None:
-            cell_list.append(_read.get_tag(cell_tag))
+            cell_list.append(kernel.cell.decode("ascii"))
         idx_keep.append(i)
     RV = {}
     RV["idx_list"] = idx_keep
@@ -234,20 +465,68 @@ def fetch_positions(samFile_list, chroms, positions, REF=None, ALT=None,
                     barcodes=None, sample_ids=None, out_file=None, 
                     cell_tag="CR", UMI_tag="UR", min_COUNT=20, min_MAF=0.1, 
                     min_MAPQ=20, max_FLAG=255, min_LEN=30, doublet_GL=False, 
-                    verbose=True):
+                    verbose=True, max_mem=None, engine="fetch", engine_log=None,
+                    io_threads=0, barcode_affix=None, no_GL=False, 
+                    raw_prefix=None, groups=None, features=None):
     """Fetch allelic expression for a list of variants across multiple samples.
-    Option 1: one single-cell sam file, a list of barcodes
+    Option 1: one or multiple single-cell sam files, a list of barcodes; the 
+    reads of all files are counted together, and barcode_affix gives the 
+    (prefix, suffix) added to the cell barcodes of each file.
     Option 2: multiple bulk sam files, multiple sample ids
-    No support for multiple sam files and barcodes.
+    max_mem: memory budget (bytes) of this worker, bounded by the batch of 
+    sites it is given (see split_sites) and a hotspot slot taken before the
+    reads of a deep chrom are loaded, as expected from the index statistics,
+    or else once the reads loaded for a site are many (see hot_enter); 
+    beyond it, the vcf lines returned without out_file and the raw counts 
+    kept in memory are moved to disk (see SpillList).
+    engine: fetch the reads of each SNP, sweep the reads of windows of nearby
+    SNPs once, or auto to choose per window by the panel density and the
+    expected depth (see plan_windows); the windows are saved in engine_log.
+    io_threads: decompression threads of each sam file.
+    no_GL: only output the counts, without reading base qualities.
+    raw_prefix: if given, save the per-cell counts of the sites passing 
+    min_COUNT into npz chunks with this prefix (see RawWriter).
+    groups: (group names, group index of each barcode), to output one column
+    per group of cells rather than per cell (see map_barcodes).
+    features: a FeatureCounter summing the AD and DP of the output SNPs over
+    the features (e.g., genes) they overlap.
     """    
-    samFile_list = [check_pysam_chrom(x, chroms[0])[0] for x in samFile_list]
+    samFile_list = [check_pysam_chrom(x, chroms[0], io_threads)[0] 
+                    for x in samFile_list]
+    # chrom -> (name in each sam file, output name, expected depth), resolved
+    # once rather than for each SNP
+    chrom_cache = {}
+    # expected depth of each contig in each sam file, from the index 
+    # statistics rather than counting the reads of each SNP
+    file_depths = [{} for x in samFile_list]
+    if hot_active():
+        file_depths = [contig_depths(x)[0] for x in samFile_list]
     if out_file is not None:
-        fid = open(out_file, "w")
-        fid.writelines(VCF_HEADER + CONTIG)
-        if barcodes is not None:
-            fid.writelines("\t".join(VCF_COLUMN + barcodes) + "\n")
+        # binary, as get_vcf_line returns bytes
+        fid = open(out_file, "wb")
+        fid.write((get_vcf_header(no_GL) + 
+                   get_contig_map(samFile_list[0]).vcf_header()).encode())
+        if groups is not None:
+            fid.write(("\t".join(VCF_COLUMN + groups[0]) + "\n").encode())
+        elif barcodes is not None:
+            fid.write(("\t".join(VCF_COLUMN + barcodes) + "\n").encode())
         else:
-            fid.writelines("\t".join(VCF_COLUMN + sample_ids) + "\n")
+            fid.write(("\t".join(VCF_COLUMN + sample_ids) + "\n").encode())
+
+    # start index -> end index of the windows to sweep
+    sweep_end = {}
+    if engine != "fetch":
+        depths, read_len = contig_depths(samFile_list[0])
+        windows = plan_windows(chroms, positions, depths, read_len, 
+                               force_sweep = engine == "sweep")
+        sweep_end = dict([(x[0], x[1]) for x in windows if x[4]])
+        if engine_log is not None:
+            write_windows(engine_log, windows, positions)
+    swept = [{} for x in samFile_list]
+    # the per-read kernel for the tags used, chosen once for the run
+    kernel = ReadKernel(cell_tag, UMI_tag, min_MAPQ, max_FLAG, min_LEN, 
+                        not no_GL)
+    raw = None if raw_prefix is None else RawWriter(raw_prefix)
 
     POS_CNT_TOTAL = len(positions)
     POS_CNT_NPRINTS = 50           # expected times to print the percentage of positions.
@@ -255,36 +534,91 @@ def fetch_positions(samFile_list, chroms, positions, REF=None, ALT=None,
     POS_CNT_PERC_N = POS_CNT_PERC_M
     POS_CNT = 0
     vcf_lines_all = []
+    if out_file is None and max_mem is not None:
+        vcf_lines_all = SpillList(max_mem // 4, raw_prefix)
+    sites = SiteBatch(vcf_lines_all.append if out_file is None else fid.write,
+                      min_COUNT, min_MAF, doublet_GL, no_GL, features)
+    cdef RunStats stats = get_stats()
     for i in range(len(positions)):
         POS_CNT += 1
+        stats.n_sites += 1
+        stats.n_units += 1
+        if POS_CNT % 1000 == 0:
+            stats.push_progress()
+            if over_budget(max_mem):
+                sites.flush()
+                spill_mem(vcf_lines_all, raw)
         if verbose and POS_CNT_TOTAL and POS_CNT >= POS_CNT_PERC_N:
             print("%.2f%% positions processed." % (POS_CNT / POS_CNT_TOTAL * 100.0))
             POS_CNT_PERC_N += POS_CNT_PERC_M
             POS_CNT_PERC_N = POS_CNT_PERC_N if POS_CNT_PERC_N <= POS_CNT_TOTAL else POS_CNT_TOTAL
         
+        if chroms[i] not in chrom_cache:
+            _names = [check_pysam_chrom(x, chroms[i])[1] for x in samFile_list]
+            # the output name, from the first sam file having the chrom
+            chrom_cache[chroms[i]] = (_names, ([x for x in _names 
+                if x is not None] + [chroms[i]])[0], 
+                sum([file_depths[s].get(_names[s], 0) 
+                     for s in range(len(_names)) if _names[s] is not None]))
+        site_chroms, out_chrom, chrom_depth = chrom_cache[chroms[i]]
+        # hold a hotspot slot from loading the reads of a deep chrom, or else
+        # from the reads loaded for this site being many, until they are 
+        # mapped
+        is_hot = hot_enter(chrom_depth)
+        n_reads = 0
+
         base_cells_sample = []
         qual_cells_sample = []
         base_merge_sample = BASE_ZERO.copy()
-        for samFile in samFile_list:
-            samFile, chrom = check_pysam_chrom(samFile, chroms[i])
-            base_list, qual_list, UMIs_list, cell_list = fetch_bases(samFile, 
-                chrom, positions[i], cell_tag, UMI_tag, min_MAPQ, max_FLAG, 
-                min_LEN)
+        reads_all = [], [], [], []
+        for s in range(len(samFile_list)):
+            samFile = samFile_list[s]
+            chrom = site_chroms[s]
+            if chrom != stats.chrom:
+                stats.set_chrom(chrom)
+            if i in sweep_end and chrom is not None:
+                _bases = sweep_bases(samFile, chrom, positions[i:sweep_end[i]], 
+                    cell_tag, UMI_tag, min_MAPQ, max_FLAG, min_LEN, kernel)
+                swept[s] = dict([(i + k, _bases[k]) for k in range(len(_bases))])
+            if i in swept[s]:
+                base_list, qual_list, UMIs_list, cell_list = swept[s].pop(i)
+            else:
+                base_list, qual_list, UMIs_list, cell_list = fetch_bases(
+                    samFile, chrom, positions[i], cell_tag, UMI_tag, min_MAPQ, 
+                    max_FLAG, min_LEN, kernel)
+            n_reads += len(base_list)
+            if not is_hot:
+                is_hot = hot_enter(n_reads)
+
+            ### for multiple single-cell files, pool the reads of all files
+            if barcodes is not None:
+                if barcode_affix is not None:
+                    cell_list, UMIs_list = add_barcode_affix(cell_list, 
+                        UMIs_list, barcode_affix[s])
+                for _all, _list in zip(reads_all, (base_list, qual_list, 
+                                                   UMIs_list, cell_list)):
+                    _all.extend(_list)
+                continue
 
             base_merge, base_cells, qual_cells = map_barcodes(base_list, 
-                qual_list, cell_list, UMIs_list, barcodes)
+                qual_list, cell_list, UMIs_list, barcodes, no_GL)
             
             ### for multiple samples
-            if barcodes is None:
-                for _key in base_merge_sample.keys():
-                    base_merge_sample[_key] += base_merge[_key]
-                base_cells_sample.append(base_cells[0])
+            for _key in base_merge_sample.keys():
+                base_merge_sample[_key] += base_merge[_key]
+            base_cells_sample.append(base_cells[0])
+            if not no_GL:
                 qual_cells_sample.append(qual_cells[0])
         
-        if barcodes is None:
+        if barcodes is not None:
+            base_list, qual_list, UMIs_list, cell_list = reads_all
+            base_merge, base_cells, qual_cells = map_barcodes(base_list, 
+                qual_list, cell_list, UMIs_list, barcodes, no_GL, groups)
+        else:
             base_merge = base_merge_sample
             base_cells = base_cells_sample
             qual_cells = qual_cells_sample
+        hot_exit(is_hot)
             
         if sum(base_merge.values()) < min_COUNT:
             continue  
@@ -296,66 +630,115 @@ def fetch_positions(samFile_list, chroms, positions, REF=None, ALT=None,
                 continue
         else:
             _REF, _ALT = None, None
-        vcf_line = get_vcf_line(base_merge, base_cells, qual_cells,
-            chrom, positions[i], min_COUNT, min_MAF, _REF, _ALT, doublet_GL)
-
-        if vcf_line is not None:
-            if out_file is None:
-                vcf_lines_all.append(vcf_line)
-            else:
-                fid.writelines(vcf_line)
+        if raw is not None:
+            raw.add(out_chrom, positions[i], _REF, _ALT, base_cells, 
+                    qual_cells)
+        sites.add(base_merge, base_cells, qual_cells, out_chrom, positions[i],
+                  _REF, _ALT)
     
+    sites.flush()
+    if raw is not None:
+        raw.close()
+    if features is not None:
+        features.close()
     if out_file is not None:
         fid.close() 
     return vcf_lines_all
 
 
-def map_barcodes(base_list, qual_list, cell_list, UMIs_list, barcodes):
+def spill_mem(vcf_lines_all, raw):
+    """Move the vcf lines (if a SpillList) and raw counts kept in memory to
+    disk, once the worker is beyond its memory budget.
+    """
+    if isinstance(vcf_lines_all, SpillList):
+        vcf_lines_all.spill()
+    if raw is not None:
+        raw.flush()
+
+
+# the barcode list of this process and its index by bytes
+BARCODE_INDEX = [None, {}]
+
+def barcode_index(barcodes):
+    """Index of the barcodes (str) by their bytes, as the cell tags are read
+    by the ReadKernel, so a read is mapped to its cell by one dict lookup 
+    without a str per read; built once for each barcode list. The first of
+    duplicated barcodes is used.
+    """
+    if BARCODE_INDEX[0] is not barcodes:
+        _index = {}
+        for i in range(len(barcodes) - 1, -1, -1):
+            _index[barcodes[i].encode()] = i
+        BARCODE_INDEX[0], BARCODE_INDEX[1] = barcodes, _index
+    return BARCODE_INDEX[1]
+
+
+def map_barcodes(base_list, qual_list, cell_list, UMIs_list, barcodes, 
+                 no_GL=False, groups=None):
     """map cell barcodes and pileup bases
+    cell_list: the cell barcodes of the reads as bytes, from the ReadKernel
+    no_GL: only count the bases, qual_list is not used and qual_cells is None
+    groups: (group names, group index of each barcode) to sum the cells of a
+    group into one column, after counting UMIs per cell
     """
     base_merge = BASE_ZERO.copy()
     
     if len(base_list) == 0:
         base_cells = [[0,0,0,0,0]] # need check
-        qual_cells = np.zeros((5, 4)) #ACGTN for GT (see qual_vector)
+        qual_cells = None if no_GL else np.zeros((5, 4)) #ACGTN for GT (see qual_vector)
         return base_merge, base_cells, qual_cells
     
+    cdef RunStats stats = get_stats()
+    cdef double t0 = stats.tic()
+
     # count UMI rather than reads
     if len(UMIs_list) == len(base_list):
         UMIs_uniq, UMIs_idx, tmp = unique_list(UMIs_list)
         base_list = [base_list[i] for i in UMIs_idx]
-        qual_list = [qual_list[i] for i in UMIs_idx]
+        if not no_GL:
+            qual_list = [qual_list[i] for i in UMIs_idx]
         if len(cell_list) > 0:
             cell_list = [cell_list[i] for i in UMIs_idx]
+        stats.toc(STAGE_UMI, t0)
+        t0 = stats.tic()
         
+    qual_cells = None
     if barcodes is not None and len(cell_list) > 0:
-        base_cells = [[0,0,0,0,0] for x in barcodes]
-        qual_cells = [np.zeros((5, 4)) for x in barcodes]
-        match_idx = id_mapping(cell_list, barcodes, uniq_ref_only=False, 
-                               IDs2_sorted=True)
+        n_cols = len(barcodes) if groups is None else len(groups[0])
+        base_cells = [[0,0,0,0,0] for x in range(n_cols)]
+        if not no_GL:
+            qual_cells = np.zeros((n_cols, 5, 4))
+        _index = barcode_index(barcodes)
 
         for i in range(len(base_list)):
-            _idx = match_idx[i]
+            _idx = _index.get(cell_list[i])
             _base = base_list[i]
-            _qual = qual_list[i]
             if _idx is not None:
+                if groups is not None:
+                    _idx = groups[1][_idx]
                 base_merge[_base] += 1
                 base_cells[_idx][BASE_IDX[_base]] += 1
-                qual_cells[_idx][BASE_IDX[_base]] += qual_vector(_qual)
+                if not no_GL:
+                    qual_cells[_idx][BASE_IDX[_base]] += qual_vector(qual_list[i])
+            else:
+                stats.rej[REJ_BARCODE] += 1
                 
     else:
-        qual_cells = [np.zeros((5, 4))]
+        if not no_GL:
+            qual_cells = [np.zeros((5, 4))]
         for i in range(len(base_list)):
             base_merge[base_list[i]] += 1
-            qual_cells[0][BASE_IDX[base_list[i]], :] += qual_vector(qual_list[i])
+            if not no_GL:
+                qual_cells[0][BASE_IDX[base_list[i]], :] += qual_vector(qual_list[i])
         base_cells = [[base_merge[x] for x in "ACGTN"]]
+    stats.toc(STAGE_BARCODE, t0)
 
     return base_merge, base_cells, qual_cells
 
 
-def get_vcf_line(base_merge, base_cells, qual_cells, chrom, POS, min_COUNT, 
-                 min_MAF, REF=None, ALT=None, doublet_GL=False):
-    """Convert the counts for all bases into a vcf line
+def vcf_ref_alt(base_merge, min_COUNT, min_MAF, REF=None, ALT=None):
+    """REF and ALT of a site, by the counts if not given, or None if the 
+    site is filtered out by min_COUNT and min_MAF (see get_vcf_line).
     """
     base_sorted = sorted(base_merge, key=base_merge.__getitem__, reverse=True)
     if REF is None or ALT is None:
@@ -366,35 +749,170 @@ def get_vcf_line(base_merge, base_cells, qual_cells, chrom, POS, min_COUNT,
     if (sum(base_merge.values()) < min_COUNT or 
         base_merge[base_sorted[1]] < min_cnt_2nd):
         return None
+    return REF, ALT
+
+
+def get_vcf_line(base_merge, base_cells, qual_cells, chrom, POS, min_COUNT, 
+                 min_MAF, REF=None, ALT=None, doublet_GL=False, no_GL=False,
+                 geno=None):
+    """Convert the counts for all bases into a vcf line, formatted natively
+    into the line buffer of the process and returned as bytes.
+    no_GL: skip GT and PL, i.e., FORMAT is AD:DP:OTH:ALL and qual_cells is 
+    not used.
+    geno: GT index and PL of the cells with reads, if computed with other 
+    sites (see SiteBatch); qual_cells is then not used.
+    """
+    cdef RunStats stats = get_stats()
+    cdef double t0 = stats.tic()
+    cdef double t1, t_gl = 0
+    _ref_alt = vcf_ref_alt(base_merge, min_COUNT, min_MAF, REF, ALT)
+    if _ref_alt is None:
+        stats.toc(STAGE_FORMAT, t0)
+        return None
+    REF, ALT = _ref_alt
 
-    FORMAT = "GT:AD:DP:OTH:PL:ALL"
     REF_cnt = base_merge[REF]
     ALT_cnt = base_merge[ALT]
     OTH_cnt = sum(base_merge.values()) - REF_cnt - ALT_cnt
     
-    INFO = "AD=%d;DP=%d;OTH=%d" %(ALT_cnt, ALT_cnt+REF_cnt, OTH_cnt)
-    
-    cells_str = []
-    for i in range(len(base_cells)):
-        _base_cell = base_cells[i]
-        _qual_cell = qual_cells[i]
-        if sum(_base_cell) == 0:
-            cells_str.append(".:.:.:.:.:.")
+    ### GT and GL of all observed cells at once
+    cnt_cells = np.ascontiguousarray(base_cells, dtype=np.intc)
+    cdef int[:, ::1] _cnt = cnt_cells
+    cdef int[::1] _gt
+    cdef int[:, ::1] _pl
+    cdef int n_obs = 0, ret
+    cdef int ref_idx = BASE_IDX[REF], alt_idx = BASE_IDX[ALT]
+    if not no_GL and geno is not None:
+        GT_idx, PL_cells = geno
+        _gt, _pl = GT_idx, PL_cells
+        n_obs = len(GT_idx)
+    elif not no_GL:
+        t1 = stats.tic()
+        obs_idx = np.flatnonzero(cnt_cells.sum(axis=1) > 0)
+        if isinstance(qual_cells, np.ndarray):
+            obs_qual = qual_cells[obs_idx]
         else:
-            _REF_cnt = _base_cell[BASE_IDX[REF]]
-            _ALT_cnt = _base_cell[BASE_IDX[ALT]]
-            _OTH_cnt = sum(_base_cell) - _REF_cnt - _ALT_cnt
-
-            ### GT and GL
-            _GT, _GL = qual_matrix_to_geno(_qual_cell, _base_cell, REF, ALT,
-                                           doublet_GL = doublet_GL)
-    
-            all_str = ",".join([str(x) for x in _base_cell])
-            cnt_lst = [str(_ALT_cnt), str(_ALT_cnt + _REF_cnt), str(_OTH_cnt)]
-            out_lst = ":".join([_GT] + cnt_lst + [_GL, all_str])
-            cells_str.append(out_lst)
-    
-    vcf_val = [chrom, str(POS), ".", REF, ALT, ".", "PASS", INFO, FORMAT]
-    vcf_line = "\t".join(vcf_val + cells_str) + "\n"
+            obs_qual = [qual_cells[i] for i in obs_idx]
+        GT_idx, PL_cells = geno_batch(obs_qual, cnt_cells[obs_idx], REF, ALT, 
+                                      doublet_GL)
+        stats.toc(STAGE_GL, t1, len(obs_idx))
+        if stats.timing:
+            t_gl += stats.tic() - t1
+        _gt, _pl = GT_idx, PL_cells
+        n_obs = len(obs_idx)
+
+    ### the fixed fields, then all cells, without a string per field
+    cdef bytes _chrom = CHROM_BYTES.get(chrom)
+    if _chrom is None:
+        _chrom = chrom.encode() if isinstance(chrom, str) else chrom
+        CHROM_BYTES[chrom] = _chrom
+    VCF_BUF.l = 0
+    _put_mem(_chrom, len(_chrom))
+    _put_mem("\t", 1)
+    _put_int(int(POS))    # a str in the panel of mode 1
+    _put_mem("\t.\t", 3)
+    _put_mem(&VCF_BASES[ref_idx], 1)
+    _put_mem("\t", 1)
+    _put_mem(&VCF_BASES[alt_idx], 1)
+    _put_str(b"\t.\tPASS\tAD=")
+    _put_int(ALT_cnt)
+    _put_str(b";DP=")
+    _put_int(ALT_cnt + REF_cnt)
+    _put_str(b";OTH=")
+    _put_int(OTH_cnt)
+    if no_GL:
+        _put_str(b"\tAD:DP:OTH:ALL")
+        ret = vcf_put_cells(&VCF_BUF, _cnt.shape[0], &_cnt[0, 0], 
+                            ref_idx, alt_idx, 0, NULL, NULL, 0)
+    else:
+        _put_str(b"\tGT:AD:DP:OTH:PL:ALL")
+        ret = vcf_put_cells(&VCF_BUF, _cnt.shape[0], &_cnt[0, 0], 
+                            ref_idx, alt_idx, n_obs, 
+                            &_gt[0] if n_obs > 0 else NULL, 
+                            &_pl[0, 0] if n_obs > 0 else NULL, _pl.shape[0])
+    if ret < 0:
+        raise MemoryError()
+    _put_str(b"\n")
+    vcf_line = PyBytes_FromStringAndSize(VCF_BUF.s, VCF_BUF.l)
+    stats.toc(STAGE_FORMAT, t0, 1, t_gl)
     
     return vcf_line
+
+
+class SiteBatch(object):
+    """The sites passing minCOUNT, waiting for their vcf lines, so GT and PL
+    of the cells with reads of many sites are computed by one kernel call 
+    (see geno_sites), rather than a call per site with few cells each. The 
+    lines are written in the order of the sites, by write (e.g., fid.write 
+    or list.append), and added to features if given. With no_GL, each line 
+    is written once its site is added.
+    """
+    def __init__(self, write, min_COUNT, min_MAF, doublet_GL=False, 
+                 no_GL=False, features=None, max_sites=GENO_SITES, 
+                 max_cells=GENO_CELLS):
+        self.write = write
+        self.min_COUNT = min_COUNT
+        self.min_MAF = min_MAF
+        self.doublet_GL = doublet_GL
+        self.no_GL = no_GL
+        self.features = features
+        self.max_sites = max_sites
+        self.max_cells = max_cells
+        self.sites = []
+        self.n_cells = 0
+
+    def add(self, base_merge, base_cells, qual_cells, chrom, POS, REF=None, 
+            ALT=None):
+        _ref_alt = vcf_ref_alt(base_merge, self.min_COUNT, self.min_MAF, REF, 
+                               ALT)
+        if _ref_alt is None:
+            return
+        if self.no_GL or _ref_alt[0] == _ref_alt[1]:
+            self.flush()
+            self.put_line(get_vcf_line(base_merge, base_cells, qual_cells, 
+                chrom, POS, self.min_COUNT, self.min_MAF, REF, ALT, 
+                self.doublet_GL, self.no_GL), base_cells)
+            return
+        # only the quality matrices of the cells with reads are kept
+        cnt_cells = np.asarray(base_cells, dtype=np.intc).reshape(-1, 5)
+        obs_idx = np.flatnonzero(cnt_cells.sum(axis=1) > 0)
+        if isinstance(qual_cells, np.ndarray):
+            obs_qual = qual_cells[obs_idx]
+        else:
+            obs_qual = np.array([qual_cells[i] for i in obs_idx]).reshape(
+                -1, 5, 4)
+        self.sites.append((base_merge, base_cells, chrom, POS, REF, ALT, 
+                           obs_qual, cnt_cells[obs_idx], _ref_alt))
+        self.n_cells += len(base_cells)
+        if len(self.sites) >= self.max_sites or self.n_cells >= self.max_cells:
+            self.flush()
+
+    def flush(self):
+        """Compute GT and PL of the sites held, and write their lines.
+        """
+        if len(self.sites) == 0:
+            return
+        cdef RunStats stats = get_stats()
+        cdef double t1 = stats.tic()
+        genos = geno_sites([(x[6], x[7], x[8][0], x[8][1]) 
+                            for x in self.sites], self.doublet_GL)
+        stats.toc(STAGE_GL, t1, sum([len(x[7]) for x in self.sites]))
+        for k in range(len(self.sites)):
+            (base_merge, base_cells, chrom, POS, REF, ALT) = self.sites[k][:6]
+            self.put_line(get_vcf_line(base_merge, base_cells, None, chrom, 
+                POS, self.min_COUNT, self.min_MAF, REF, ALT, self.doublet_GL, 
+                False, genos[k]), base_cells)
+        self.sites = []
+        self.n_cells = 0
+
+    def put_line(self, vcf_line, base_cells):
+        if vcf_line is None:
+            return
+        cdef RunStats stats = get_stats()
+        cdef double t0 = stats.tic()
+        self.write(vcf_line)
+        stats.toc(STAGE_WRITE, t0)
+        stats.n_lines += 1
+        stats.n_bytes += len(vcf_line)
+        if self.features is not None:
+            self.features.add(vcf_line, base_cells)
@@ -0,0 +1,177 @@
+# Utilility functions for the raw per-cell base counts of the pileup, which
+# are re-filtered and genotyped again without the sam files
+# Date: 17/10/2026
+
+import os
+import shutil
+import numpy as np
+
+RAW_CHUNK_NNZ = 500000    # observed cells of one chunk file
+RAW_SAMPLES = "samples.tsv"
+RAW_CONTIGS = "contigs.txt"
+
+class RawWriter(object):
+    """Collect the per-cell ACGTN counts and quality sums (see qual_vector)
+    of the sites passing minCOUNT, sparse over the cells with reads, and save
+    them into npz chunk files prefix0.npz, prefix1.npz, ..., a new chunk for
+    each contig or every max_nnz observed cells.
+    """
+    def __init__(self, prefix, max_nnz=RAW_CHUNK_NNZ):
+        self.prefix = prefix
+        self.max_nnz = max_nnz
+        self.n_files = 0
+        self._reset()
+
+    def _reset(self):
+        self.chrom = None
+        self.pos, self.ref, self.alt = [], [], []
+        self.cells, self.counts, self.quals = [], [], []
+        self.indptr = [0]
+        self.nnz = 0
+
+    def add(self, chrom, pos, REF, ALT, base_cells, qual_cells):
+        """Add a site; REF and ALT are None if they are chosen by counts, and
+        qual_cells is None without GL.
+        """
+        if chrom != self.chrom and len(self.pos) > 0:
+            self.flush()
+        self.chrom = chrom
+        _cnt = np.asarray(base_cells, dtype=np.int32)
+        _idx = np.flatnonzero(_cnt.sum(axis=1) > 0)
+        self.pos.append(int(pos))
+        self.ref.append("" if REF is None else REF)
+        self.alt.append("" if ALT is None else ALT)
+        self.cells.append(_idx.astype(np.int32))
+        self.counts.append(_cnt[_idx])
+        if qual_cells is not None:
+            if isinstance(qual_cells, np.ndarray):
+                _qual = qual_cells[_idx]
+            else:
+                _qual = np.array([qual_cells[i] for i in _idx])
+            self.quals.append(_qual.reshape(-1, 5, 4))
+        self.nnz += len(_idx)
+        self.indptr.append(self.nnz)
+        if self.nnz >= self.max_nnz:
+            self.flush()
+
+    def flush(self):
+        if len(self.pos) == 0:
+            return
+        arrays = {
+            "chrom": np.array([self.chrom]),
+            "pos": np.array(self.pos, dtype=np.int64),
+            "ref": np.array(self.ref),
+            "alt": np.array(self.alt),
+            "indptr": np.array(self.indptr, dtype=np.int64),
+            "cells": np.concatenate(self.cells),
+            "counts": np.concatenate(self.counts).reshape(-1, 5)
+        }
+        if len(self.quals) > 0:
+            arrays["quals"] = np.concatenate(self.quals).reshape(-1, 5, 4)
+        np.savez_compressed("%s%d.npz" %(self.prefix, self.n_files), **arrays)
+        self.n_files += 1
+        self._reset()
+
+    def close(self):
+        self.flush()
+
+
+def merge_raw(raw_dir, prefixes, vcf_file):
+    """Move the chunk files of all jobs into raw_dir, numbered in the order of
+    prefixes, and save the sample names of the #CHROM line and the ##contig
+    lines of vcf_file. Return the number of chunks.
+    """
+    if os.path.exists(raw_dir):
+        shutil.rmtree(raw_dir)
+    os.makedirs(raw_dir)
+    contig_lines = []
+    with open(vcf_file, "r") as fid:
+        for line in fid:
+            if line.startswith("##contig="):
+                contig_lines.append(line)
+            if line.startswith("#CHROM"):
+                samples = line.rstrip("\n").split("\t")[9:]
+                break
+    with open(os.path.join(raw_dir, RAW_SAMPLES), "w") as fid:
+        fid.writelines([x + "\n" for x in samples])
+    with open(os.path.join(raw_dir, RAW_CONTIGS), "w") as fid:
+        fid.writelines(contig_lines)
+    n_chunk = 0
+    for _prefix in prefixes:
+        k = 0
+        while os.path.isfile("%s%d.npz" %(_prefix, k)):
+            shutil.move("%s%d.npz" %(_prefix, k),
+                        os.path.join(raw_dir, "chunk_%06d.npz" %n_chunk))
+            n_chunk += 1
+            k += 1
+    return n_chunk
+
+def load_raw_samples(raw_dir):
+    with open(os.path.join(raw_dir, RAW_SAMPLES), "r") as fid:
+        return [x.rstrip("\n") for x in fid]
+
+def iter_raw_sites(raw_dir):
+    """Yield (chrom, pos, REF, ALT, cells, counts, quals) of each site saved
+    in raw_dir; REF and ALT are None if not given, and quals is None if the
+    pileup was run without GL.
+    """
+    chunks = sorted([x for x in os.listdir(raw_dir) if x.startswith("chunk_")
+                     and x.endswith(".npz")])
+    for _chunk in chunks:
+        # each array is read once, as NpzFile loads it on every access
+        with np.load(os.path.join(raw_dir, _chunk)) as dat:
+            chrom, pos = str(dat["chrom"][0]), dat["pos"]
+            indptr = dat["indptr"]
+            ref, alt = dat["ref"].tolist(), dat["alt"].tolist()
+            cells, counts = dat["cells"], dat["counts"]
+            quals = dat["quals"] if "quals" in dat.files else None
+        for j in range(len(pos)):
+            s, e = indptr[j], indptr[j + 1]
+            yield (chrom, int(pos[j]), ref[j] or None, alt[j] or None,
+                   cells[s:e], counts[s:e],
+                   None if quals is None else quals[s:e])
+
+def refilter_raw(raw_dir, out_file, min_COUNT=20, min_MAF=0.0,
+                 doublet_GL=False, no_GL=False, count_REF=False):
+    """Re-apply minCOUNT, minMAF, the REF/ALT choice and genotyping to the
+    sites saved in raw_dir, and write the vcf lines into out_file, as
+    get_vcf_line in the pileup. count_REF chooses REF and ALT by the counts
+    even if the SNP panel gave them. Return the number of vcf lines.
+    """
+    from .pileup_utils import get_vcf_header, CONTIG, VCF_COLUMN, get_vcf_line
+
+    samples = load_raw_samples(raw_dir)
+    n_cells = len(samples)
+    # the contig lines of the pileup, from its sam header if saved
+    contig_lines = CONTIG
+    _contig_file = os.path.join(raw_dir, RAW_CONTIGS)
+    if os.path.isfile(_contig_file):
+        with open(_contig_file, "r") as fid:
+            contig_lines = fid.read() or CONTIG
+    # dense buffers of all cells, only the rows of a site are set and reset
+    cnt_buf = np.zeros((n_cells, 5), dtype=np.intc)
+    qual_buf = None if no_GL else np.zeros((n_cells, 5, 4))
+
+    fid = open(out_file, "wb")
+    fid.write((get_vcf_header(no_GL) + contig_lines).encode())
+    fid.write(("\t".join(VCF_COLUMN + samples) + "\n").encode())
+    n_lines = 0
+    for chrom, pos, REF, ALT, cells, counts, quals in iter_raw_sites(raw_dir):
+        if not no_GL and quals is None:
+            raise ValueError("no quality sums in %s, use noGL." %raw_dir)
+        base_merge = dict(zip("ACGTN", counts.sum(axis=0).tolist()))
+        if count_REF:
+            REF, ALT = None, None
+        cnt_buf[cells] = counts
+        if not no_GL:
+            qual_buf[cells] = quals
+        vcf_line = get_vcf_line(base_merge, cnt_buf, qual_buf, chrom, pos,
+            min_COUNT, min_MAF, REF, ALT, doublet_GL, no_GL)
+        cnt_buf[cells] = 0
+        if not no_GL:
+            qual_buf[cells] = 0
+        if vcf_line is not None:
+            fid.write(vcf_line)
+            n_lines += 1
+    fid.close()
+    return n_lines
@@ -0,0 +1,203 @@
+# Utilility functions for memory-bounded scheduling of pileup jobs
+# Date: 17/10/2026
+
+import os
+import sys
+import tempfile
+
+## rough memory model of one worker, in bytes
+WORKER_BASE_MEM = 200 * 1024 ** 2  # python, pysam and numpy of a fresh worker
+CELL_SITE_MEM = 400                # per barcode per site: 5x4 qual matrix + ALL counts
+READ_SITE_MEM = 300                # per read per site: base, qual, UMI and cell strings
+CELL_LINE_MEM = 40                 # per barcode of one vcf line kept in memory
+TYPICAL_DEPTH = 100                # reads per site for sizing a worker
+HOT_DEPTH = 10000                  # reads per site considered as a hotspot
+MIN_REGION_JOB = 100000            # bp of a mode 2 job on the regions of a BED
+
+global HOT_SEM
+global HOT_MIN_DEPTH
+HOT_SEM = None
+HOT_MIN_DEPTH = HOT_DEPTH
+
+def parse_mem(mem_str):
+    """Parse a memory size like 800M, 16G or 1024 (bytes) into bytes.
+    """
+    if mem_str is None:
+        return None
+    mem_str = str(mem_str).strip().upper().rstrip("B")
+    units = {"K": 1024, "M": 1024 ** 2, "G": 1024 ** 3, "T": 1024 ** 4}
+    if mem_str[-1:] in units:
+        return int(float(mem_str[:-1]) * units[mem_str[-1]])
+    return int(float(mem_str))
+
+def get_rss():
+    """Return the current resident set size of this process in bytes.
+    """
+    try:
+        with open("/proc/self/statm", "r") as fid:
+            return int(fid.read().split()[1]) * os.sysconf("SC_PAGE_SIZE")
+    except (IOError, OSError, ValueError):
+        import resource
+        rss = resource.getrusage(resource.RUSAGE_SELF).ru_maxrss
+        return rss if sys.platform == "darwin" else rss * 1024
+
+def estimate_site_mem(n_cells, depth=TYPICAL_DEPTH):
+    """Estimated peak memory (bytes) for processing one site.
+    """
+    n_cells = 1 if n_cells is None else max(1, n_cells)
+    return n_cells * CELL_SITE_MEM + depth * READ_SITE_MEM
+
+def plan_workers(nproc, max_mem, n_cells):
+    """Decide the number of workers and hotspot slots for a memory budget.
+
+    Return (n_workers, n_hot, worker_mem): each worker is allowed worker_mem
+    bytes, and at most n_hot workers process a hotspot site at the same time.
+    """
+    if max_mem is None:
+        return nproc, nproc, None
+    worker_need = WORKER_BASE_MEM + estimate_site_mem(n_cells)
+    n_workers = max(1, min(nproc, int(max_mem // worker_need)))
+    if n_workers < nproc:
+        print("[cellSNP] Warning: --maxMEM allows %d of %d subprocesses."
+              %(n_workers, nproc))
+    hot_need = estimate_site_mem(n_cells, HOT_DEPTH)
+    spare_mem = max_mem - n_workers * worker_need
+    n_hot = max(1, min(n_workers, int(spare_mem // hot_need)))
+    return n_workers, n_hot, int(max_mem // n_workers)
+
+def split_sites(n_sites, n_workers, worker_mem=None, n_cells=None):
+    """Split n_sites into (start, end) batches.
+
+    Without a memory budget, use one batch per worker as before. Otherwise
+    the batch size is bounded so that the vcf lines of one batch fit in the
+    spare memory of one worker, giving more and smaller batches.
+    """
+    n_workers = max(1, n_workers)
+    if worker_mem is None:
+        LEN_div = n_sites // n_workers
+        bounds = [LEN_div * i for i in range(n_workers)] + [n_sites]
+    else:
+        line_mem = (1 if n_cells is None else max(1, n_cells)) * CELL_LINE_MEM
+        spare_mem = max(worker_mem - WORKER_BASE_MEM, 0) // 2
+        batch = -(-n_sites // n_workers)
+        batch = max(1, min(batch, max(1000, spare_mem // line_mem)))
+        bounds = list(range(0, n_sites, batch)) + [n_sites]
+    return [(bounds[i], bounds[i+1]) for i in range(len(bounds) - 1) 
+            if bounds[i+1] > bounds[i]]
+
+def split_regions(chroms, regions, n_workers, n_chunks=4, 
+                  min_bp=MIN_REGION_JOB):
+    """Split the regions of each chrom into jobs of about the same bp, 
+    n_chunks jobs per worker, cutting the regions longer than a job; one job
+    per chrom with one worker. Return a list of (chrom, list of (start, end),
+    bp of the job).
+    """
+    total = sum([x[1] - x[0] for _chrom in chroms for x in regions[_chrom]])
+    if n_workers <= 1:
+        target = max(1, total)
+    else:
+        target = max(min_bp, -(-total // (n_workers * n_chunks)))
+    jobs = []
+    for _chrom in chroms:
+        _job, _bp = [], 0
+        for start, end in regions[_chrom]:
+            while start < end:
+                _len = min(end - start, target - _bp)
+                _job.append((start, start + _len))
+                _bp += _len
+                start += _len
+                if _bp >= target:
+                    jobs.append((_chrom, _job, _bp))
+                    _job, _bp = [], 0
+        if len(_job) > 0:
+            jobs.append((_chrom, _job, _bp))
+    return jobs
+
+def init_mem_guard(hot_sem=None, hot_depth=HOT_DEPTH):
+    """Set the hotspot semaphore of this (worker) process.
+    """
+    global HOT_SEM
+    global HOT_MIN_DEPTH
+    HOT_SEM = hot_sem
+    HOT_MIN_DEPTH = hot_depth
+
+def hot_enter(depth):
+    """Acquire a hotspot slot if depth is high; return True if acquired.
+    """
+    if HOT_SEM is None or depth < HOT_MIN_DEPTH:
+        return False
+    HOT_SEM.acquire()
+    return True
+
+def hot_active():
+    """True if this process shares hotspot slots with other workers.
+    """
+    return HOT_SEM is not None
+
+def hot_exit(acquired):
+    if acquired:
+        HOT_SEM.release()
+
+def over_budget(max_mem):
+    """Check if this process uses more memory than max_mem bytes.
+    """
+    return max_mem is not None and get_rss() > max_mem
+
+
+class SpillList(object):
+    """A list of vcf lines (bytes), which spills to a temp file beyond 
+    max_bytes or on spill().
+
+    It supports append(), len() and iteration like a list. The spilled lines
+    are read back once: the temp file is removed after the iteration, or by
+    close() if the lines are not needed.
+    """
+    def __init__(self, max_bytes=None, prefix=None):
+        self.max_bytes = max_bytes
+        self.prefix = prefix
+        self.lines = []
+        self.n_bytes = 0
+        self.n_spilled = 0
+        self.spill_file = None
+
+    def append(self, line):
+        self.lines.append(line)
+        self.n_bytes += len(line)
+        if self.max_bytes is not None and self.n_bytes > self.max_bytes:
+            self.spill()
+
+    def spill(self):
+        """Write the lines in memory to the temp file.
+        """
+        if len(self.lines) == 0:
+            return
+        if self.spill_file is None:
+            _dir = None if self.prefix is None else os.path.dirname(self.prefix)
+            fd, self.spill_file = tempfile.mkstemp(prefix="cellSNP.spill_",
+                                                   dir=_dir or None)
+            os.close(fd)
+        with open(self.spill_file, "ab") as fid:
+            fid.writelines(self.lines)
+        self.n_spilled += len(self.lines)
+        self.lines = []
+        self.n_bytes = 0
+
+    def __len__(self):
+        return self.n_spilled + len(self.lines)
+
+    def __iter__(self):
+        if self.spill_file is not None:
+            with open(self.spill_file, "rb") as fid:
+                for line in fid:
+                    yield line
+            self.close()
+        for line in self.lines:
+            yield line
+
+    def close(self):
+        """Remove the temp file and forget the spilled lines.
+        """
+        if self.spill_file is not None and os.path.exists(self.spill_file):
+            os.remove(self.spill_file)
+        self.spill_file = None
+        self.n_spilled = 0
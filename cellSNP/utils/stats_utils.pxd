@@ -0,0 +1,40 @@
+# stages timed by RunStats, see STAGE_NAMES in stats_utils.pyx
+cdef enum:
+    STAGE_SEEK = 0
+    STAGE_INFLATE = 1
+    STAGE_DECODE = 2
+    STAGE_FILTER = 3
+    STAGE_UMI = 4
+    STAGE_BARCODE = 5
+    STAGE_GL = 6
+    STAGE_FORMAT = 7
+    STAGE_WRITE = 8
+    N_STAGE = 9
+
+# reasons of rejecting a read, see REJECT_NAMES in stats_utils.pyx
+cdef enum:
+    REJ_DEL_SKIP = 0
+    REJ_MAPQ = 1
+    REJ_FLAG = 2
+    REJ_LEN = 3
+    REJ_NO_CELL = 4
+    REJ_NO_UMI = 5
+    REJ_BARCODE = 6
+    N_REJECT = 7
+
+cdef double now_sec() nogil
+
+cdef class RunStats:
+    cdef public bint timing
+    cdef double t[N_STAGE]
+    cdef long long n[N_STAGE]
+    cdef public long long n_sites, n_reads, n_lines, n_bytes
+    cdef public long long n_units
+    cdef public long long n_sweep, n_sweep_sites
+    cdef long long rej[N_REJECT]
+    cdef public object chrom
+    cdef public dict rej_chrom
+    cdef double tic(self)
+    cdef void toc(self, int stage, double t0, long long cnt=*, double excl=*)
+
+cdef RunStats get_stats()
@@ -0,0 +1,262 @@
+# Utilility functions for per-stage timing and counters of pileup jobs
+# Date: 17/10/2026
+
+import sys
+import json
+import time
+import multiprocessing
+from posix.time cimport clock_gettime, timespec, CLOCK_MONOTONIC
+
+STAGE_NAMES = ["seek", "inflate", "decode", "filter", "UMI", "barcode",
+               "GL", "format", "write"]
+COUNTER_NAMES = ["sites", "reads", "lines", "bytes", "sweep_windows", 
+                 "sweep_sites"]
+REJECT_NAMES = ["del_refskip", "MAPQ", "FLAG", "LEN", "no_cell_tag", 
+                "no_UMI_tag", "barcode"]
+
+## shared progress block: one slot of N_PROGRESS counters per worker, i.e.,
+## cost units done (sites in mode 1&3, bp in mode 2), sites, reads and bytes.
+N_PROGRESS = 4
+_PROGRESS = None
+_SLOT = 0
+_PROG_BASE = [0] * N_PROGRESS
+
+cdef double now_sec() nogil:
+    cdef timespec ts
+    clock_gettime(CLOCK_MONOTONIC, &ts)
+    return ts.tv_sec + ts.tv_nsec * 1e-9
+
+
+cdef class RunStats:
+    """Counters and stage timers of one process.
+
+    The counters are always kept. The timers are only updated when timing is
+    set, otherwise tic() and toc() cost a branch each.
+    The rejected reads are counted by reason (see REJECT_NAMES) for the
+    current chromosome, which are folded into rej_chrom by set_chrom().
+    Reads are counted once per site they cover, and barcodes not in the list
+    are counted after UMI grouping.
+    seek:     index lookup when starting a fetch or pileup iterator
+    inflate:  advancing the iterator, i.e., BGZF inflate and bam record parse
+    decode:   extracting the base and quality of a read at a position
+    filter:   read filtering on MAPQ, FLAG, length and tags
+    UMI:      UMI grouping
+    barcode:  mapping cell barcodes and counting bases per cell
+    GL:       genotype likelihoods
+    format:   formatting vcf lines, excluding GL
+    write:    writing vcf lines
+    """
+    def __cinit__(self):
+        self.reset(False)
+
+    def reset(self, timing=None):
+        cdef int i
+        if timing is not None:
+            self.timing = timing
+        for i in range(N_STAGE):
+            self.t[i] = 0
+            self.n[i] = 0
+        self.n_sites = 0
+        self.n_reads = 0
+        self.n_lines = 0
+        self.n_bytes = 0
+        self.n_units = 0
+        self.n_sweep = 0
+        self.n_sweep_sites = 0
+        for i in range(N_REJECT):
+            self.rej[i] = 0
+        self.chrom = None
+        self.rej_chrom = {}
+
+    def set_chrom(self, chrom):
+        """Fold the reject counters of the current chromosome into rej_chrom,
+        and start counting for chrom.
+        """
+        cdef int i
+        cdef long long n_rej = 0
+        for i in range(N_REJECT):
+            n_rej += self.rej[i]
+        if n_rej > 0:
+            _key = "*" if self.chrom is None else self.chrom
+            _rej = self.rej_chrom.setdefault(_key, [0] * N_REJECT)
+            for i in range(N_REJECT):
+                _rej[i] += self.rej[i]
+        for i in range(N_REJECT):
+            self.rej[i] = 0
+        self.chrom = chrom
+
+    def push_progress(self, final=False):
+        """Copy the counters into the shared progress slot of this worker.
+        The slot is cumulative over all jobs of the worker.
+        """
+        if _PROGRESS is None:
+            return
+        cdef int i
+        _counts = [self.n_units, self.n_sites, self.n_reads, self.n_bytes]
+        for i in range(N_PROGRESS):
+            _PROGRESS[_SLOT * N_PROGRESS + i] = _PROG_BASE[i] + _counts[i]
+            if final:
+                _PROG_BASE[i] += _counts[i]
+
+    cdef double tic(self):
+        return now_sec() if self.timing else 0
+
+    cdef void toc(self, int stage, double t0, long long cnt=1, double excl=0):
+        if self.timing:
+            self.t[stage] += now_sec() - t0 - excl
+            self.n[stage] += cnt
+
+    def to_dict(self):
+        cdef int i
+        self.set_chrom(self.chrom)
+        RV = {"timing": bool(self.timing), "stages": {}, "counters": {
+            "sites": self.n_sites, "reads": self.n_reads,
+            "lines": self.n_lines, "bytes": self.n_bytes, 
+            "sweep_windows": self.n_sweep, "sweep_sites": self.n_sweep_sites},
+            "rejected": dict([(x, 0) for x in REJECT_NAMES]), 
+            "rejected_by_chrom": {}}
+        for i in range(N_STAGE):
+            RV["stages"][STAGE_NAMES[i]] = {"sec": self.t[i], "calls": self.n[i]}
+        for _chrom in self.rej_chrom:
+            _rej = self.rej_chrom[_chrom]
+            RV["rejected_by_chrom"][_chrom] = dict(zip(REJECT_NAMES, _rej))
+            for i in range(N_REJECT):
+                RV["rejected"][REJECT_NAMES[i]] += _rej[i]
+        return RV
+
+
+cdef RunStats _STATS = RunStats()
+
+cdef RunStats get_stats():
+    return _STATS
+
+def current_stats():
+    """Return the RunStats of this process.
+    """
+    return _STATS
+
+def run_with_stats(func, args, timing=False):
+    """Run func(*args) with fresh stats of this (worker) process.
+    Return (result of func, stats dict).
+    """
+    _STATS.reset(timing)
+    RV = func(*args)
+    _STATS.push_progress(True)
+    return RV, _STATS.to_dict()
+
+def new_progress(n_slots):
+    """Create a shared progress block for n_slots workers, and a counter for
+    assigning the slots. Pass both to init_progress() in each worker.
+    """
+    block = multiprocessing.RawArray("q", n_slots * N_PROGRESS)
+    slot_counter = multiprocessing.Value("i", 0)
+    return block, slot_counter
+
+def init_progress(block, slot_counter):
+    """Take a slot of the shared progress block for this worker.
+    """
+    global _PROGRESS
+    global _SLOT
+    with slot_counter.get_lock():
+        _SLOT = slot_counter.value
+        slot_counter.value += 1
+    _PROGRESS = block
+
+def _fmt_num(x):
+    for _unit in ["", "K", "M", "G"]:
+        if abs(x) < 1000:
+            return "%.1f%s" %(x, _unit)
+        x /= 1000.0
+    return "%.1fT" %x
+
+def _fmt_time(sec):
+    sec = int(sec)
+    if sec >= 3600:
+        return "%dh%02dm" %(sec // 3600, sec % 3600 // 60)
+    return "%dm%02ds" %(sec // 60, sec % 60)
+
+def monitor_progress(results, block, total_cost, interval=10):
+    """Print one consolidated progress line for all workers, with sites/s, 
+    reads/s and an ETA from the cost units done, until all results are ready.
+    """
+    t0 = time.time()
+    t_print = 0
+    n_slots = len(block) // N_PROGRESS
+    is_tty = sys.stdout.isatty()
+    while True:
+        done = all([res.ready() for res in results])
+        elapsed = time.time() - t0
+        if done or elapsed - t_print >= interval:
+            t_print = elapsed
+            _sum = [sum([block[j * N_PROGRESS + i] for j in range(n_slots)])
+                    for i in range(N_PROGRESS)]
+            units, sites, reads, n_bytes = _sum
+            frac = min(1.0, units / total_cost) if total_cost > 0 else 0
+            rate = units / elapsed if elapsed > 0 else 0
+            eta = (total_cost - units) / rate if rate > 0 else 0
+            line = ("[cellSNP] %.1f%% done, %s sites/s, %s reads/s, %sB "
+                    "written, ETA %s" %(frac * 100, _fmt_num(sites / 
+                    max(elapsed, 1e-9)), _fmt_num(reads / max(elapsed, 1e-9)), 
+                    _fmt_num(n_bytes), _fmt_time(max(eta, 0))))
+            if is_tty:
+                sys.stdout.write("\r" + line + " " * 4)
+            else:
+                sys.stdout.write(line + "\n")
+            sys.stdout.flush()
+        if done:
+            break
+        time.sleep(0.5)
+    if is_tty:
+        sys.stdout.write("\n")
+
+def merge_stats(stats_list):
+    """Sum the stats dicts of all jobs.
+    """
+    RV = RunStats().to_dict()
+    RV["jobs"] = 0
+    for _stats in stats_list:
+        if _stats is None:
+            continue
+        RV["jobs"] += 1
+        RV["timing"] = RV["timing"] or _stats["timing"]
+        for _key in _stats["counters"]:
+            RV["counters"][_key] += _stats["counters"][_key]
+        for _key in _stats["stages"]:
+            RV["stages"][_key]["sec"] += _stats["stages"][_key]["sec"]
+            RV["stages"][_key]["calls"] += _stats["stages"][_key]["calls"]
+        for _key in _stats["rejected"]:
+            RV["rejected"][_key] += _stats["rejected"][_key]
+        for _chrom in _stats["rejected_by_chrom"]:
+            _rej = RV["rejected_by_chrom"].setdefault(_chrom, 
+                dict([(x, 0) for x in REJECT_NAMES]))
+            for _key in _stats["rejected_by_chrom"][_chrom]:
+                _rej[_key] += _stats["rejected_by_chrom"][_chrom][_key]
+    return RV
+
+def reject_summary(stats):
+    """Format the rejected reads of merged stats into a line for printing.
+    """
+    n_reads = stats["counters"]["reads"]
+    _rej = ["%s %d (%.1f%%)" %(x, stats["rejected"][x], 
+            100.0 * stats["rejected"][x] / max(n_reads, 1)) 
+            for x in REJECT_NAMES if stats["rejected"][x] > 0]
+    if len(_rej) == 0:
+        _rej = ["none"]
+    return ("[cellSNP] %d reads fetched; rejected: %s" 
+            %(n_reads, ", ".join(_rej)))
+
+def write_stats(json_file, stats_list, run_time=None, info=None):
+    """Merge the stats of all jobs and save them into a json file.
+    """
+    RV = merge_stats(stats_list) if type(stats_list) == list else stats_list
+    total_sec = sum([RV["stages"][x]["sec"] for x in STAGE_NAMES])
+    for _key in STAGE_NAMES:
+        _stage = RV["stages"][_key]
+        _stage["fraction"] = _stage["sec"] / total_sec if total_sec > 0 else 0
+        _stage["ns_per_call"] = (_stage["sec"] * 1e9 / _stage["calls"]
+                                 if _stage["calls"] > 0 else 0)
+    RV["run_time"] = run_time
+    RV["info"] = info
+    with open(json_file, "w") as fid:
+        json.dump(RV, fid, indent=2)
+    return RV
@@ -0,0 +1,315 @@
+# Utilility functions for piling up a coordinate-sorted stream of reads,
+# e.g., from stdin, without index or random access
+# Date: 17/10/2026
+
+import sys
+import heapq
+from bisect import bisect_left
+from .pileup_utils import get_vcf_header, VCF_COLUMN, map_barcodes, \
+    get_vcf_line, check_pysam_chrom, get_contig_map
+from .raw_utils import RawWriter
+from libc.stdint cimport uint32_t
+from pysam.libchtslib cimport BAM_CDIFF, BAM_CEQUAL, BAM_CINS, BAM_CMATCH, BAM_CSOFT_CLIP
+from pysam.libchtslib cimport BAM_CDEL, BAM_CREF_SKIP
+from pysam.libchtslib cimport bam1_t, bam_get_cigar, bam_cigar_op, bam_cigar_oplen
+from pysam.libcalignedsegment cimport AlignedSegment
+from .cellsnp_utils cimport ReadKernel
+from .stats_utils cimport RunStats, get_stats, STAGE_INFLATE, STAGE_DECODE, \
+    STAGE_FILTER, STAGE_WRITE, REJ_DEL_SKIP
+
+cdef int _add_site(RunStats stats, ReadKernel kernel, AlignedSegment read, 
+                   long pos, int qpos, int reason, dict pending, 
+                   list heap) except -1:
+    """Count a read at a 0-based pos, with its query offset (-1 if deleted or
+    skipped) and filter reason (-1 if kept); heap is None with a panel.
+    """
+    stats.n_reads += 1
+    if qpos < 0:
+        stats.rej[REJ_DEL_SKIP] += 1
+        return 0
+    if reason >= 0:
+        stats.rej[reason] += 1
+        return 0
+    if pos not in pending:
+        pending[pos] = ([], [], [], [])
+        if heap is not None:
+            heapq.heappush(heap, pos)
+    kernel.add(read, qpos, pending[pos])
+    return 0
+
+def stream_sites(samFile, panel=None, chroms=None, cell_tag="CR",
+                 UMI_tag="UR", min_MAPQ=20, max_FLAG=255, min_LEN=30, 
+                 with_qual=True):
+    """Pile up the reads of a coordinate-sorted sam file in one pass.
+
+    panel: dict of contig id (tid in the header, see ContigMap) -> 
+    increasing 0-based positions to pile up, where all of them are yielded,
+    also without reads; if None, all positions with reads in chroms (a set 
+    of contig ids, None for all) are yielded.
+    A position is yielded once the stream has passed it, so only the reads
+    overlapping positions ahead of the stream are kept. Reads are filtered
+    as fetch_bases, and counted for each position they are aligned to, in 
+    one walk over the CIGAR; without with_qual, the quality lists are left 
+    empty. Unlike the pileup of an indexed file (pysam), there is no maximum
+    depth, and overlapping mates are both counted.
+    Yield (chrom, 0-based pos, (base_list, qual_list, UMIs_list, cell_list)).
+    """
+    cdef RunStats stats = get_stats()
+    cdef AlignedSegment _read
+    cdef double t0
+    cdef bam1_t *b
+    cdef uint32_t *cigar
+    cdef uint32_t c, l
+    cdef int tid = -2, k, k_end, op, q, reason
+    cdef long last_start = -1, _start, _end, r, _pos
+    chrom, pos0, p_idx = None, [], 0
+    pending, heap = {}, []
+    cdef ReadKernel kernel = ReadKernel(cell_tag, UMI_tag, min_MAPQ, max_FLAG,
+                                        min_LEN, with_qual)
+    references = samFile.references
+
+    t0 = stats.tic()
+    for _read in samFile:
+        stats.toc(STAGE_INFLATE, t0)
+        if _read.reference_id < 0:
+            break    # unmapped reads are at the end of a sorted file
+        _start = _read.reference_start
+        if _read.reference_id != tid:
+            if _read.reference_id < tid:
+                print("[cellSNP] Error: the input is not sorted by coordinate.")
+                sys.exit(1)
+            ## flush the previous chrom
+            if panel is not None:
+                while p_idx < len(pos0):
+                    yield chrom, pos0[p_idx], pending.pop(pos0[p_idx],
+                                                          ([], [], [], []))
+                    p_idx += 1
+            while len(heap) > 0:
+                _pos = heapq.heappop(heap)
+                yield chrom, _pos, pending.pop(_pos)
+            tid = _read.reference_id
+            chrom = references[tid]
+            stats.set_chrom(chrom)
+            if panel is not None:
+                pos0 = panel.get(tid, [])
+                p_idx = 0
+            else:
+                pos0 = None if chroms is None or tid in chroms else []
+        elif _start < last_start:
+            print("[cellSNP] Error: the input is not sorted by coordinate.")
+            sys.exit(1)
+        last_start = _start
+
+        ## yield the positions the stream has passed
+        if panel is not None:
+            while p_idx < len(pos0) and pos0[p_idx] < _start:
+                yield chrom, pos0[p_idx], pending.pop(pos0[p_idx],
+                                                      ([], [], [], []))
+                p_idx += 1
+        while len(heap) > 0 and heap[0] < _start:
+            _pos = heapq.heappop(heap)
+            yield chrom, _pos, pending.pop(_pos)
+        if pos0 is not None and len(pos0) == 0:
+            t0 = stats.tic()
+            continue    # chrom not used
+
+        b = _read._delegate
+        k, k_end = 0, 0
+        if panel is not None:
+            # the panel positions within the aligned span of the read
+            _end = (_read.reference_end if _read.reference_end is not None
+                    else _start + 1)
+            k = bisect_left(pos0, _start, p_idx)
+            k_end = bisect_left(pos0, _end, k)
+            if k == k_end:
+                t0 = stats.tic()
+                continue
+
+        t0 = stats.tic()
+        reason = kernel.check(_read)
+        stats.toc(STAGE_FILTER, t0)
+
+        ## walk the CIGAR once, with the query offset of each aligned block;
+        ## the panel positions outside the blocks are deleted or skipped
+        t0 = stats.tic()
+        cigar = bam_get_cigar(b)
+        r, q = _start, 0
+        for c in range(b.core.n_cigar if b.core.l_qseq > 0 else 0):
+            op = bam_cigar_op(cigar[c])
+            l = bam_cigar_oplen(cigar[c])
+            if op == BAM_CMATCH or op == BAM_CEQUAL or op == BAM_CDIFF:
+                if panel is None:
+                    for _pos in range(r, r + l):
+                        _add_site(stats, kernel, _read, _pos, q + (_pos - r), 
+                                  reason, pending, heap)
+                else:
+                    while k < k_end and pos0[k] < r + l:
+                        _pos = pos0[k]
+                        _add_site(stats, kernel, _read, _pos, 
+                                  q + (_pos - r) if _pos >= r else -1, 
+                                  reason, pending, None)
+                        k += 1
+                r += l
+                q += l
+            elif op == BAM_CSOFT_CLIP or op == BAM_CINS:
+                q += l
+            elif op == BAM_CDEL or op == BAM_CREF_SKIP:
+                r += l
+        while k < k_end:
+            _add_site(stats, kernel, _read, pos0[k], -1, reason, pending, None)
+            k += 1
+        stats.toc(STAGE_DECODE, t0)
+        t0 = stats.tic()
+
+    ## flush the last chrom
+    if panel is not None:
+        while p_idx < len(pos0):
+            yield chrom, pos0[p_idx], pending.pop(pos0[p_idx], ([], [], [], []))
+            p_idx += 1
+    while len(heap) > 0:
+        _pos = heapq.heappop(heap)
+        yield chrom, _pos, pending.pop(_pos)
+
+
+def _write_line(fid, vcf_line, RunStats stats):
+    cdef double t0 = stats.tic()
+    fid.write(vcf_line)
+    stats.toc(STAGE_WRITE, t0)
+    stats.n_lines += 1
+    stats.n_bytes += len(vcf_line)
+
+def stream_positions(sam_file, chroms, positions, REF=None, ALT=None, 
+                     barcodes=None, sample_ids=None, out_file=None, 
+                     cell_tag="CR", UMI_tag="UR", min_COUNT=20, min_MAF=0.1, 
+                     min_MAPQ=20, max_FLAG=255, min_LEN=30, doublet_GL=False, 
+                     verbose=True, io_threads=0, no_GL=False, 
+                     raw_prefix=None, groups=None, features=None):
+    """Fetch allelic expression for a list of variants from a coordinate-
+    sorted stream (e.g., "-" for stdin) of one sam file, as fetch_positions 
+    but sweeping the sorted panel alongside the stream. The variants are 
+    output in the order of the stream; groups sums the cells of each group
+    into one column, see map_barcodes, and features sums the output SNPs of
+    each feature, see FeatureCounter.
+    """
+    samFile = check_pysam_chrom(sam_file, None, io_threads)[0]
+    contigs = get_contig_map(samFile)
+    # contig id -> sorted 0-based positions, and (contig id, pos) -> variant
+    # indices; the variants on contigs not in the header have no reads
+    panel, site_idx = {}, {}
+    for i in range(len(positions)):
+        _key = (contigs.tid(chroms[i]), int(positions[i]) - 1)
+        if _key[0] < 0:
+            continue
+        if _key not in site_idx:
+            site_idx[_key] = []
+            panel.setdefault(_key[0], []).append(_key[1])
+        site_idx[_key].append(i)
+    for _tid in panel:
+        panel[_tid].sort()
+
+    fid = open(out_file, "wb")
+    fid.write((get_vcf_header(no_GL) + contigs.vcf_header()).encode())
+    if groups is not None:
+        fid.write(("\t".join(VCF_COLUMN + groups[0]) + "\n").encode())
+    elif barcodes is not None:
+        fid.write(("\t".join(VCF_COLUMN + barcodes) + "\n").encode())
+    else:
+        fid.write(("\t".join(VCF_COLUMN + sample_ids[:1]) + "\n").encode())
+
+    cdef RunStats stats = get_stats()
+    raw = None if raw_prefix is None else RawWriter(raw_prefix)
+    POS_CNT = 0
+    for chrom, pos, _lists in stream_sites(samFile, panel, None, cell_tag, 
+                                           UMI_tag, min_MAPQ, max_FLAG, min_LEN,
+                                           not no_GL):
+        POS_CNT += 1
+        stats.n_sites += 1
+        stats.n_units += 1
+        if verbose and POS_CNT % 100000 == 0:
+            print("%s: %d positions processed." %(chrom, POS_CNT))
+        base_merge, base_cells, qual_cells = map_barcodes(_lists[0], _lists[1], 
+            _lists[3], _lists[2], barcodes, no_GL, groups)
+        if sum(base_merge.values()) < min_COUNT:
+            continue
+        for i in site_idx[(contigs.tids[chrom], pos)]:
+            if REF is not None and ALT is not None:
+                _REF, _ALT = REF[i], ALT[i]
+                #only support single nucleotide variants
+                if len(_REF) > 1 or len(_ALT) > 1:
+                    continue
+            else:
+                _REF, _ALT = None, None
+            if raw is not None:
+                raw.add(chrom, positions[i], _REF, _ALT, base_cells, qual_cells)
+            vcf_line = get_vcf_line(base_merge, base_cells, qual_cells, chrom, 
+                positions[i], min_COUNT, min_MAF, _REF, _ALT, doublet_GL, no_GL)
+            if vcf_line is not None:
+                _write_line(fid, vcf_line, stats)
+                if features is not None:
+                    features.add(vcf_line, base_cells)
+    if raw is not None:
+        raw.close()
+    if features is not None:
+        features.close()
+    fid.close()
+    return []
+
+def stream_regions(sam_file, barcodes, out_file=None, chroms=None, 
+                   cell_tag="CR", UMI_tag="UR", min_COUNT=20, min_MAF=0.1, 
+                   min_MAPQ=20, max_FLAG=255, min_LEN=30, doublet_GL=False, 
+                   verbose=True, io_threads=0, no_GL=False, raw_prefix=None,
+                   groups=None, features=None, contig_filter=None):
+    """Pileup allelic specific expression for whole chromosomes from a 
+    coordinate-sorted stream (e.g., "-" for stdin) of one sam file, as 
+    pileup_regions, piling up the positions as the reads arrive; groups sums
+    the cells of each group into one column, see map_barcodes, and features
+    sums the output SNPs of each feature, see FeatureCounter. Without chroms,
+    the contigs of the stream header are used, filtered by contig_filter, 
+    (pattern, min length) as ContigMap.select, if given.
+    """
+    samFile = check_pysam_chrom(sam_file, None, io_threads)[0]
+    contigs = get_contig_map(samFile)
+    if chroms is None and contig_filter is not None:
+        chroms = contigs.select(*contig_filter)
+    fid = open(out_file, "wb")
+    fid.write((get_vcf_header(no_GL) + contigs.vcf_header()).encode())
+    if groups is not None:
+        fid.write(("\t".join(VCF_COLUMN + groups[0]) + "\n").encode())
+    elif barcodes is not None:
+        fid.write(("\t".join(VCF_COLUMN + barcodes) + "\n").encode())
+    else:
+        fid.write(("\t".join(VCF_COLUMN + ["sample0"]) + "\n").encode())
+
+    cdef RunStats stats = get_stats()
+    raw = None if raw_prefix is None else RawWriter(raw_prefix)
+    POS_CNT = 0
+    _tids = None if chroms is None else set([contigs.tid(x) for x in chroms])
+    for chrom, pos, _lists in stream_sites(samFile, None, _tids, cell_tag, 
+                                           UMI_tag, min_MAPQ, max_FLAG, min_LEN,
+                                           not no_GL):
+        POS_CNT += 1
+        stats.n_sites += 1
+        stats.n_units = pos + 1
+        if verbose and POS_CNT % 1000000 == 0:
+            print("%s: %dM positions processed." %(chrom, POS_CNT/1000000))
+        if len(_lists[0]) < min_COUNT:
+            continue
+        base_merge, base_cells, qual_cells = map_barcodes(_lists[0], _lists[1], 
+            _lists[3], _lists[2], barcodes, no_GL, groups)
+        if sum(base_merge.values()) < min_COUNT:
+            continue
+        if raw is not None:
+            raw.add(chrom, pos + 1, None, None, base_cells, qual_cells)
+        vcf_line = get_vcf_line(base_merge, base_cells, qual_cells, chrom, 
+            pos + 1, min_COUNT, min_MAF, REF = None, ALT = None, 
+            doublet_GL = doublet_GL, no_GL = no_GL)
+        if vcf_line is not None:
+            _write_line(fid, vcf_line, stats)
+            if features is not None:
+                features.add(vcf_line, base_cells)
+    if raw is not None:
+        raw.close()
+    if features is not None:
+        features.close()
+    fid.close()
+    return []
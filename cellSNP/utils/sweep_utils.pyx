@@ -0,0 +1,184 @@
+# Utilility functions for choosing per region between fetching each SNP and
+# sweeping the reads of a window of SNPs once
+# Date: 17/10/2026
+
+import os
+from bisect import bisect_left
+from .contig_utils import chrom_aliases
+from pysam.libcalignedsegment cimport AlignedSegment
+from .cellsnp_utils cimport query_offset, ReadKernel
+from .stats_utils cimport RunStats, get_stats, STAGE_SEEK, STAGE_INFLATE, \
+    STAGE_DECODE, STAGE_FILTER, REJ_DEL_SKIP
+
+ENGINES = ["fetch", "sweep", "auto"]
+
+## cost model in units of one read visited: a fetch costs SEEK_COST plus the
+## depth of the SNP; a sweep costs SEEK_COST plus the reads overlapping the
+## window, i.e., depth * (1 + span / read length).
+SEEK_COST = 50            # index lookup and inflating the first BGZF block
+DEFAULT_DEPTH = 10        # expected depth if the index has no read counts
+DEFAULT_READ_LEN = 100
+MAX_SWEEP_SITES = 2000    # SNPs of one window, whose reads are held together
+MAX_SWEEP_SPAN = 1000000  # bp of one window
+
+ENGINE_LOG_HEADER = "#CHROM\tSTART\tEND\tSITES\tDEPTH\tENGINE\n"
+
+def contig_depths(samFile, n_reads=1000):
+    """Expected read depth of each contig from the index, i.e., mapped reads
+    times the mean aligned length of the first n_reads reads, divided by the
+    contig length. Return (depths dict, read length).
+    """
+    _len = [x.query_alignment_length for x in samFile.head(n_reads)
+            if not x.is_unmapped]
+    read_len = float(sum(_len)) / len(_len) if len(_len) > 0 else DEFAULT_READ_LEN
+    depths = {}
+    try:
+        for _stat in samFile.get_index_statistics():
+            _ref_len = samFile.get_reference_length(_stat.contig)
+            if _ref_len > 0:
+                depths[_stat.contig] = _stat.mapped * read_len / _ref_len
+    except (ValueError, AttributeError, NotImplementedError):
+        pass    # e.g., cram or sam without index statistics
+    return depths, read_len
+
+def _contig_depth(depths, chrom):
+    if chrom in depths:
+        return depths[chrom]
+    for _chrom in chrom_aliases(chrom):
+        if _chrom in depths:
+            return depths[_chrom]
+    return DEFAULT_DEPTH
+
+def plan_windows(chroms, positions, depths, read_len=DEFAULT_READ_LEN,
+                 force_sweep=False, seek_cost=SEEK_COST,
+                 max_sites=MAX_SWEEP_SITES, max_span=MAX_SWEEP_SPAN):
+    """Group the SNPs into windows, and choose fetch or sweep for each.
+
+    A window is extended with the next SNP (same chrom, larger position) if
+    sweeping over the gap visits fewer reads than fetching the SNP, i.e.,
+    gap < read_len * (1 + seek_cost / depth); so dense panels and shallow
+    regions are swept, sparse panels and deep regions are fetched.
+    force_sweep extends windows up to max_sites and max_span regardless.
+    Return a list of (start index, end index, chrom, depth, is_sweep).
+    """
+    windows = []
+    cdef int i = 0, j, n = len(positions)
+    cdef double depth, max_gap
+    cdef long _pos, _prev, _first
+    while i < n:
+        depth = max(_contig_depth(depths, chroms[i]), 1e-3)
+        max_gap = max_span if force_sweep else read_len * (1 + seek_cost / depth)
+        _first = _prev = int(positions[i])
+        j = i + 1
+        while j < n and j - i < max_sites and chroms[j] == chroms[i]:
+            _pos = int(positions[j])
+            if _pos <= _prev or _pos - _prev > max_gap or _pos - _first > max_span:
+                break
+            _prev = _pos
+            j += 1
+        windows.append((i, j, chroms[i], depth, j - i > 1))
+        i = j
+    return windows
+
+def write_windows(log_file, windows, positions):
+    """Write the engine of each region, merging consecutive fetched windows.
+    """
+    fid = open(log_file, "w")
+    _region = None
+    for start, end, chrom, depth, is_sweep in windows:
+        if (_region is not None and not is_sweep and not _region[4] and
+            _region[0] == chrom):
+            _region[2] = positions[end - 1]
+            _region[3] += end - start
+            continue
+        if _region is not None:
+            fid.writelines("%s\t%s\t%s\t%d\t%.1f\t%s\n" %(_region[0],
+                _region[1], _region[2], _region[3], _region[5],
+                "sweep" if _region[4] else "fetch"))
+        _region = [chrom, positions[start], positions[end - 1], end - start,
+                   is_sweep, depth]
+    if _region is not None:
+        fid.writelines("%s\t%s\t%s\t%d\t%.1f\t%s\n" %(_region[0], _region[1],
+            _region[2], _region[3], _region[5],
+            "sweep" if _region[4] else "fetch"))
+    fid.close()
+
+def merge_engine_logs(log_file, log_files):
+    """Concatenate the engine logs of all jobs, and count the sites by engine.
+    """
+    cnt = {"fetch": 0, "sweep": 0}
+    n_win = {"fetch": 0, "sweep": 0}
+    fid_out = open(log_file, "w")
+    fid_out.writelines(ENGINE_LOG_HEADER)
+    for _file in log_files:
+        if not os.path.isfile(_file):
+            continue
+        with open(_file, "r") as fid_in:
+            for line in fid_in:
+                _val = line.rstrip("\n").split("\t")
+                cnt[_val[5]] += int(_val[3])
+                n_win[_val[5]] += 1
+                fid_out.writelines(line)
+        os.remove(_file)
+    fid_out.close()
+    return cnt, n_win
+
+def sweep_bases(samFile, chrom, positions, cell_tag="CR", UMI_tag="UR",
+                min_MAPQ=20, max_FLAG=255, min_LEN=30, ReadKernel kernel=None):
+    """Fetch bases for a window of SNPs by iterating its reads once.
+    Same as calling fetch_bases for each position: a read is counted and
+    filtered for each SNP it overlaps, and the reads of each SNP keep the
+    order of the bam file. Return a list of (base_list, qual_list, UMIs_list,
+    cell_list) in the order of positions (1-based, increasing).
+    kernel: the ReadKernel of the run for these options, created if None.
+    """
+    RV = [([], [], [], []) for x in positions]
+    pos0 = [int(x) - 1 for x in positions]
+    if samFile is None or chrom is None or len(pos0) == 0:
+        return RV
+
+    cdef RunStats stats = get_stats()
+    cdef double t0 = stats.tic()
+    read_iter = samFile.fetch(chrom, pos0[0], pos0[-1] + 1)
+    stats.toc(STAGE_SEEK, t0)
+
+    cdef AlignedSegment _read
+    cdef int k, m, idx, reason
+    cdef long _start, _end
+    if kernel is None:
+        kernel = ReadKernel(cell_tag, UMI_tag, min_MAPQ, max_FLAG, min_LEN)
+    t0 = stats.tic()
+    for _read in read_iter:
+        stats.toc(STAGE_INFLATE, t0)
+        t0 = stats.tic()
+        _start = _read.reference_start
+        _end = _read.reference_end if _read.reference_end is not None else _start + 1
+        k = bisect_left(pos0, _start)
+        if k >= len(pos0) or pos0[k] >= _end:
+            stats.toc(STAGE_DECODE, t0)
+            t0 = stats.tic()
+            continue    # between SNPs
+        stats.toc(STAGE_DECODE, t0)
+
+        ## read-level filters, checked once but counted per SNP as fetch_bases
+        t0 = stats.tic()
+        reason = kernel.check(_read)
+        stats.toc(STAGE_FILTER, t0)
+
+        t0 = stats.tic()
+        m = k
+        while m < len(pos0) and pos0[m] < _end:
+            stats.n_reads += 1
+            idx = query_offset(_read._delegate, pos0[m])
+            if idx < 0:
+                stats.rej[REJ_DEL_SKIP] += 1
+            elif reason >= 0:
+                stats.rej[reason] += 1
+            else:
+                kernel.add(_read, idx, RV[m])
+            m += 1
+        stats.toc(STAGE_DECODE, t0)
+        t0 = stats.tic()
+    stats.n_sweep += 1
+    stats.n_sweep_sites += len(pos0)
+    return RV
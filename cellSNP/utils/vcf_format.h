@@ -0,0 +1,156 @@
+/* Formatting vcf lines into a growable byte buffer, see get_vcf_line in
+ * pileup_utils.pyx.
+ * Date: 17/10/2026
+ *
+ * The buffer is reused for all lines of a process, so formatting a line only
+ * allocates when it is longer than any line before. Functions return 0, or
+ * -1 if the buffer cannot grow.
+ */
+
+#ifndef CELLSNP_VCF_FORMAT_H
+#define CELLSNP_VCF_FORMAT_H
+
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+    size_t l, m;
+    char *s;
+} vcf_buf_t;
+
+static const char VCF_DIGITS[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233"
+    "34353637383940414243444546474849505152535455565758596061626364656667"
+    "6869707172737475767778798081828384858687888990919293949596979899";
+
+static const char VCF_MISSING_CELL[] = "\t.:.:.:.:.:.";
+static const char VCF_MISSING_COUNT[] = "\t.:.:.:.";
+
+static const char *VCF_GT_STR[] = {"0/0", "1/0", "1/1"};
+
+static inline int vcf_buf_reserve(vcf_buf_t *b, size_t n)
+{
+    size_t m;
+    char *s;
+    if (b->l + n <= b->m)
+        return 0;
+    m = b->m < 4096 ? 4096 : b->m;
+    while (m < b->l + n)
+        m *= 2;
+    s = (char *)realloc(b->s, m);
+    if (s == NULL)
+        return -1;
+    b->s = s;
+    b->m = m;
+    return 0;
+}
+
+static inline void vcf_buf_free(vcf_buf_t *b)
+{
+    free(b->s);
+    b->s = NULL;
+    b->l = b->m = 0;
+}
+
+/* the caller reserves the space in the unchecked vcf_push_* */
+static inline void vcf_push_mem(vcf_buf_t *b, const char *s, size_t n)
+{
+    memcpy(b->s + b->l, s, n);
+    b->l += n;
+}
+
+static inline void vcf_push_int(vcf_buf_t *b, long x)
+{
+    char tmp[24];
+    char *p = tmp + sizeof(tmp);
+    unsigned long u = x < 0 ? -(unsigned long)x : (unsigned long)x;
+    while (u >= 100) {
+        p -= 2;
+        memcpy(p, VCF_DIGITS + (u % 100) * 2, 2);
+        u /= 100;
+    }
+    if (u >= 10) {
+        p -= 2;
+        memcpy(p, VCF_DIGITS + u * 2, 2);
+    } else {
+        *--p = (char)('0' + u);
+    }
+    if (x < 0)
+        *--p = '-';
+    vcf_push_mem(b, p, tmp + sizeof(tmp) - p);
+}
+
+static inline int vcf_put_mem(vcf_buf_t *b, const char *s, size_t n)
+{
+    if (vcf_buf_reserve(b, n) < 0)
+        return -1;
+    vcf_push_mem(b, s, n);
+    return 0;
+}
+
+static inline int vcf_put_int(vcf_buf_t *b, long x)
+{
+    if (vcf_buf_reserve(b, 24) < 0)
+        return -1;
+    vcf_push_int(b, x);
+    return 0;
+}
+
+/*
+ * @abstract     Append the GT:AD:DP:OTH:PL:ALL fields of all cells, each
+ *               after a tab; cells without reads are ".:.:.:.:.:.". If n_gl
+ *               is 0, only the AD:DP:OTH:ALL fields, missing as ".:.:.:.".
+ * @param n      Number of cells.
+ * @param cnt    Base counts, cnt[i * 5 + b] for base b (ACGTN) of cell i.
+ * @param ref    Index of REF in ACGTN.
+ * @param alt    Index of ALT in ACGTN.
+ * @param n_obs  Number of cells with reads, in the order of the cells.
+ * @param gt     GT index of the cells with reads, see cellsnp_gl_batch.
+ * @param pl     PL of the cells with reads, pl[g * n_obs + k].
+ * @param n_gl   Number of PL values of a cell, 0 without GT and PL.
+ */
+static inline int vcf_put_cells(vcf_buf_t *b, int n, const int *cnt, int ref,
+                                int alt, int n_obs, const int *gt,
+                                const int *pl, int n_gl)
+{
+    /* a cell field is at most 32 chars (GT and separators) plus 5 + 5
+     * counts and n_gl PLs of up to 11 digits with the sign */
+    size_t max_cell = 32 + (10 + n_gl) * 11;
+    const char *missing = n_gl ? VCF_MISSING_CELL : VCF_MISSING_COUNT;
+    size_t n_missing = n_gl ? sizeof(VCF_MISSING_CELL) - 1
+                            : sizeof(VCF_MISSING_COUNT) - 1;
+    const int *c;
+    int i, g, k = 0;
+    for (i = 0; i < n; i++) {
+        c = cnt + i * 5;
+        if (c[0] + c[1] + c[2] + c[3] + c[4] == 0 || (n_gl && k >= n_obs)) {
+            if (vcf_put_mem(b, missing, n_missing) < 0)
+                return -1;
+            continue;
+        }
+        if (vcf_buf_reserve(b, max_cell) < 0)
+            return -1;
+        b->s[b->l++] = '\t';
+        if (n_gl) {
+            vcf_push_mem(b, VCF_GT_STR[gt[k]], 3);
+            b->s[b->l++] = ':';
+        }
+        vcf_push_int(b, c[alt]);
+        b->s[b->l++] = ':';
+        vcf_push_int(b, c[alt] + c[ref]);
+        b->s[b->l++] = ':';
+        vcf_push_int(b, c[0] + c[1] + c[2] + c[3] + c[4] - c[ref] - c[alt]);
+        for (g = 0; g < n_gl; g++) {
+            b->s[b->l++] = g == 0 ? ':' : ',';
+            vcf_push_int(b, pl[g * n_obs + k]);
+        }
+        for (g = 0; g < 5; g++) {
+            b->s[b->l++] = g == 0 ? ':' : ',';
+            vcf_push_int(b, c[g]);
+        }
+        k++;
+    }
+    return 0;
+}
+
+#endif
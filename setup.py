@@ -47,7 +47,8 @@ extra_compile_args = [
 ]
 
 # List cython extensions in order.
-# pileup_utils and pileup_regions depend on cellsnp_utils.
+# pileup_utils and pileup_regions depend on cellsnp_utils, contig_utils, 
+# schedule_utils and stats_utils.
 ext_modules = [
     dict(name = "cellSNP.utils.cellsnp_utils",
         language = "c",
@@ -57,14 +58,48 @@ ext_modules = [
         language = "c",
         sources = [path.join('cellSNP', 'utils', 'base_utils.pyx')],
         libraries = []),
+    dict(name = "cellSNP.utils.contig_utils",
+        language = "c",
+        sources = [path.join('cellSNP', 'utils', 'contig_utils.pyx')],
+        libraries = []),
+    dict(name = "cellSNP.utils.schedule_utils",
+        language = "c",
+        sources = [path.join('cellSNP', 'utils', 'schedule_utils.pyx')],
+        libraries = []),
+    dict(name = "cellSNP.utils.stats_utils",
+        language = "c",
+        sources = [path.join('cellSNP', 'utils', 'stats_utils.pyx')],
+        libraries = []),
+    dict(name = "cellSNP.utils.sweep_utils",
+        language = "c",
+        sources = [path.join('cellSNP', 'utils', 'sweep_utils.pyx')],
+        libraries = []),
+    dict(name = "cellSNP.utils.raw_utils",
+        language = "c",
+        sources = [path.join('cellSNP', 'utils', 'raw_utils.pyx')],
+        libraries = []),
+    dict(name = "cellSNP.utils.feature_utils",
+        language = "c",
+        sources = [path.join('cellSNP', 'utils', 'feature_utils.pyx')],
+        libraries = []),
     dict(name = "cellSNP.utils.pileup_utils",
         language = "c",
         sources = [path.join('cellSNP', 'utils', 'pileup_utils.pyx')],
+        depends = [path.join('cellSNP', 'utils', 'gl_kernel.h'),
+                   path.join('cellSNP', 'utils', 'vcf_format.h')],
         libraries = []),
     dict(name = "cellSNP.utils.pileup_regions",
         language = "c",
         sources = [path.join('cellSNP', 'utils', 'pileup_regions.pyx')],
         libraries = []),
+    dict(name = "cellSNP.utils.stream_utils",
+        language = "c",
+        sources = [path.join('cellSNP', 'utils', 'stream_utils.pyx')],
+        libraries = []),
+    dict(name = "cellSNP.utils.bench_utils",
+        language = "c",
+        sources = [path.join('cellSNP', 'utils', 'bench_utils.pyx')],
+        libraries = []),
     dict(name = "cellSNP.utils.vcf_utils",
         language = "c",
         sources = [path.join('cellSNP', 'utils', 'vcf_utils.pyx')],
@@ -0,0 +1,198 @@
+# benchmark cellSNP modes 1, 2 and 3 on data from synth_10x.py
+# Date: 17/10/2026
+
+import os
+import sys
+import json
+import gzip
+import time
+import shutil
+import platform
+import threading
+import subprocess
+from optparse import OptionParser, OptionGroup
+
+def tree_rss(pid):
+    """Sum of the resident set size (bytes) of pid and all its descendants.
+    """
+    children = {}
+    rss = {}
+    page_size = os.sysconf("SC_PAGE_SIZE")
+    for _pid in os.listdir("/proc"):
+        if not _pid.isdigit():
+            continue
+        try:
+            with open("/proc/%s/stat" %_pid, "r") as fid:
+                stat = fid.read().rsplit(")", 1)[1].split()
+            children.setdefault(int(stat[1]), []).append(int(_pid))
+            rss[int(_pid)] = int(stat[21]) * page_size
+        except (IOError, OSError, IndexError, ValueError):
+            continue
+    total, stack = 0, [pid]
+    while len(stack) > 0:
+        _pid = stack.pop()
+        total += rss.get(_pid, 0)
+        stack += children.get(_pid, [])
+    return total
+
+def run_command(cmd, log_file, interval=0.2):
+    """Run cmd, return wall time, cpu time, and the peak rss of the largest
+    process and of the whole process tree.
+    """
+    peak = [0]
+    done = threading.Event()
+    with open(log_file, "w") as fid:
+        t0 = time.time()
+        pro = subprocess.Popen(cmd, stdout=fid, stderr=subprocess.STDOUT)
+
+        # sample the rss of the process tree; the child is reaped by wait4
+        def _sample():
+            while not done.is_set():
+                if os.path.isdir("/proc"):
+                    peak[0] = max(peak[0], tree_rss(pro.pid))
+                done.wait(interval)
+        sampler = threading.Thread(target=_sample)
+        sampler.daemon = True
+        sampler.start()
+        _pid, status, rusage = os.wait4(pro.pid, 0)
+        wall = time.time() - t0
+        done.set()
+        sampler.join()
+        pro.returncode = os.waitstatus_to_exitcode(status) \
+            if hasattr(os, "waitstatus_to_exitcode") else status >> 8
+    maxrss = rusage.ru_maxrss * (1 if sys.platform == "darwin" else 1024)
+    return {
+        "returncode": pro.returncode,
+        "wall_sec": wall,
+        "cpu_sec": rusage.ru_utime + rusage.ru_stime,
+        "peak_rss_mb": maxrss / 1024.0 ** 2,
+        "peak_tree_rss_mb": peak[0] / 1024.0 ** 2
+    }
+
+def count_vcf_sites(vcf_file):
+    if not os.path.isfile(vcf_file):
+        return 0
+    cnt = 0
+    with gzip.open(vcf_file, "rb") as fid:
+        for line in fid:
+            if not line.startswith(b"#"):
+                cnt += 1
+    return cnt
+
+def dir_size(out_dir):
+    size = 0
+    for root, dirs, files in os.walk(out_dir):
+        for _file in files:
+            size += os.path.getsize(os.path.join(root, _file))
+    return size
+
+def mode_command(mode, meta, out_dir, cellSNP, nproc, extra):
+    """Return the cellSNP command, sites and reads to process for a mode.
+    """
+    cmd = [cellSNP, "-O", out_dir, "-p", str(nproc)]
+    if mode == 1:
+        cmd += ["-s", meta["sam_file"], "-b", meta["barcode_file"],
+                "-R", meta["region_file"]]
+        n_sites, n_reads = meta["n_snp"], meta["n_reads"]
+    elif mode == 2:
+        cmd += ["-s", meta["sam_file"], "-b", meta["barcode_file"],
+                "--chrom", ",".join(meta["contigs"])]
+        n_sites = meta["contig_len"] * len(meta["contigs"])
+        n_reads = meta["n_reads"]
+    else:
+        sample_ids = ["bulk_%d" %i for i in range(len(meta["bulk_files"]))]
+        cmd += ["-s", ",".join(meta["bulk_files"]), "-I", ",".join(sample_ids),
+                "-R", meta["region_file"], "--UMItag", "None"]
+        n_sites, n_reads = meta["n_snp"], meta["n_bulk_reads"]
+    return cmd + extra, n_sites, n_reads
+
+def main():
+    # parse command line options
+    parser = OptionParser()
+    parser.add_option("--dataDir", "-i", dest="data_dir", default=None,
+        help=("Directory generated by synth_10x.py, with synth.json."))
+    parser.add_option("--outDir", "-o", dest="out_dir", default=None,
+        help=("Directory for the cellSNP outputs and logs."))
+    parser.add_option("--outJSON", "-j", dest="out_json", default=None,
+        help=("Output json file [default: $outDir/bench.json]"))
+
+    group1 = OptionGroup(parser, "Optional arguments")
+    group1.add_option("--modes", dest="modes", default="1,2,3",
+        help="Comma separated cellSNP modes to run [default: %default]")
+    group1.add_option("--nproc", "-p", type="int", dest="nproc", default=1,
+        help="Number of subprocesses for cellSNP [default: %default]")
+    group1.add_option("--repeat", type="int", dest="repeat", default=1,
+        help="Number of runs per mode [default: %default]")
+    group1.add_option("--cellSNP", dest="cellSNP", default="cellSNP",
+        help="The cellSNP command to benchmark [default: %default]")
+    group1.add_option("--extra", dest="extra", default="",
+        help="Extra arguments passed to cellSNP, e.g., \"--minCOUNT 10\"")
+    parser.add_option_group(group1)
+
+    (options, args) = parser.parse_args()
+    if len(sys.argv[1:]) == 0:
+        print("Welcome to bench_10x!\n")
+        print("use -h or --help for help on argument.")
+        sys.exit(1)
+
+    if options.data_dir is None or not os.path.isfile(
+        os.path.join(options.data_dir, "synth.json")):
+        print("Error: need dataDir with synth.json from synth_10x.py.")
+        sys.exit(1)
+    if options.out_dir is None:
+        print("Error: need outDir for outputs.")
+        sys.exit(1)
+    if not os.path.exists(options.out_dir):
+        os.makedirs(options.out_dir)
+    out_json = options.out_json
+    if out_json is None:
+        out_json = os.path.join(options.out_dir, "bench.json")
+
+    with open(os.path.join(options.data_dir, "synth.json"), "r") as fid:
+        meta = json.load(fid)
+
+    records = []
+    for mode in [int(x) for x in options.modes.split(",")]:
+        for rep in range(options.repeat):
+            out_dir = os.path.join(options.out_dir, "mode%d_%d" %(mode, rep))
+            if os.path.exists(out_dir):
+                shutil.rmtree(out_dir)
+            cmd, n_sites, n_reads = mode_command(mode, meta, out_dir,
+                options.cellSNP, options.nproc, options.extra.split())
+            RV = run_command(cmd, out_dir + ".log")
+            RV["mode"] = mode
+            RV["repeat"] = rep
+            RV["nproc"] = options.nproc
+            RV["command"] = " ".join(cmd)
+            RV["sites"] = n_sites
+            RV["reads"] = n_reads
+            RV["sites_per_sec"] = n_sites / max(RV["wall_sec"], 1e-9)
+            RV["reads_per_sec"] = n_reads / max(RV["wall_sec"], 1e-9)
+            RV["out_sites"] = count_vcf_sites(
+                os.path.join(out_dir, "cellSNP.cells.vcf.gz"))
+            RV["out_bytes"] = dir_size(out_dir)
+            records.append(RV)
+            print("[bench_10x] mode %d run %d: %.1f sec, %.0f sites/s, "
+                  "%.0f reads/s, %.0f MB" %(mode, rep, RV["wall_sec"],
+                  RV["sites_per_sec"], RV["reads_per_sec"],
+                  RV["peak_tree_rss_mb"]))
+            if RV["returncode"] != 0:
+                print("[bench_10x] Warning: mode %d failed, see %s.log"
+                      %(mode, out_dir))
+
+    bench = {
+        "time": time.strftime("%Y-%m-%d %H:%M:%S"),
+        "host": platform.node(),
+        "platform": platform.platform(),
+        "python": platform.python_version(),
+        "cpu_count": os.cpu_count(),
+        "data": meta,
+        "runs": records
+    }
+    with open(out_json, "w") as fid:
+        json.dump(bench, fid, indent=2)
+    print("[bench_10x] results saved in %s" %out_json)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,47 @@
+# microbenchmark the per-read and per-site kernels of cellSNP
+# Date: 17/10/2026
+
+import sys
+import json
+from optparse import OptionParser
+from cellSNP.utils.bench_utils import run_benchmarks, KERNELS
+
+def main():
+    # parse command line options
+    parser = OptionParser()
+    parser.add_option("--outJSON", "-o", dest="out_json", default=None,
+        help=("Output json file for the records [optional]."))
+    parser.add_option("--sizes", "-s", dest="sizes", default="10,100,1000",
+        help=("Comma separated reads (or observed cells) per site "
+              "[default: %default]"))
+    parser.add_option("--nCELL", "-n", type="int", dest="n_cells",
+        default=5000, help=("Number of barcodes in the list "
+                            "[default: %default]"))
+    parser.add_option("--kernels", "-k", dest="kernels", default=None,
+        help=("Comma separated kernels to run [default: all of %s]"
+              %",".join(sorted(set([x[0] for x in KERNELS])))))
+    parser.add_option("--minTIME", type="float", dest="min_time", default=0.2,
+        help=("Minimum seconds to time each kernel [default: %default]"))
+    parser.add_option("--seed", type="int", dest="seed", default=0,
+        help=("Seed for the random inputs [default: %default]"))
+
+    (options, args) = parser.parse_args()
+    sizes = [int(x) for x in options.sizes.split(",")]
+    kernels = None if options.kernels is None else options.kernels.split(",")
+
+    records = run_benchmarks(sizes, options.n_cells, options.min_time,
+                             kernels, options.seed)
+
+    print("%-22s %-8s %8s %14s %16s" %("kernel", "variant", "size", "ns/op",
+                                       "peak_alloc_bytes"))
+    for RV in records:
+        print("%-22s %-8s %8d %14.1f %16d" %(RV["kernel"], RV["variant"],
+              RV["size"], RV["ns_per_op"], RV["peak_alloc_bytes"]))
+
+    if options.out_json is not None:
+        with open(options.out_json, "w") as fid:
+            json.dump(records, fid, indent=2)
+
+
+if __name__ == "__main__":
+    main()
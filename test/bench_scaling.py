@@ -0,0 +1,217 @@
+# scaling benchmark of cellSNP over cell count, nproc and SNP density
+# Date: 17/10/2026
+
+import os
+import sys
+import json
+import time
+import shutil
+import platform
+import subprocess
+import numpy as np
+from optparse import OptionParser, OptionGroup
+from bench_10x import run_command, mode_command, count_vcf_sites
+
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+
+def make_data(data_dir, n_cell, density, options):
+    """Generate synthetic data with synth_10x.py, reused if it exists.
+    """
+    out_dir = os.path.join(data_dir, "c%d_d%g" %(n_cell, density))
+    meta_file = os.path.join(out_dir, "synth.json")
+    if not os.path.isfile(meta_file):
+        cmd = [sys.executable, os.path.join(TEST_DIR, "synth_10x.py"),
+               "-o", out_dir, "--seed", str(options.seed),
+               "--nCELL", str(n_cell), "--density", str(density),
+               "--depth", str(options.depth), "--nCONTIG", str(options.n_contig),
+               "--contigLEN", str(options.contig_len)]
+        subprocess.check_call(cmd)
+    with open(meta_file, "r") as fid:
+        return json.load(fid)
+
+def fit_slope(xx, yy):
+    """Slope of log(y) on log(x), i.e., the exponent k in y ~ x^k.
+    """
+    idx = [i for i in range(len(xx)) if xx[i] > 0 and yy[i] > 0]
+    if len(idx) < 2:
+        return None
+    return float(np.polyfit(np.log([xx[i] for i in idx]),
+                            np.log([yy[i] for i in idx]), 1)[0])
+
+def print_table(records, axis):
+    print("\n[bench_scaling] sweep over %s" %axis)
+    print("%6s %10s %8s %8s %10s %10s %10s %10s" %("mode", axis, "wall_s",
+          "cpu_s", "cpu_eff", "speedup", "sites/s", "rss_MB"))
+    for RV in records:
+        print("%6d %10s %8.1f %8.1f %10.2f %10.2f %10.0f %10.0f" %(RV["mode"],
+              RV[axis], RV["wall_sec"], RV["cpu_sec"], RV["cpu_efficiency"],
+              RV["speedup"], RV["sites_per_sec"], RV["peak_tree_rss_mb"]))
+
+def plot_sweeps(sweeps, out_file):
+    import matplotlib
+    matplotlib.use("Agg")
+    import matplotlib.pyplot as plt
+    fig, axes = plt.subplots(2, len(sweeps), figsize=(4 * len(sweeps), 6),
+                             squeeze=False)
+    for j, axis in enumerate(sweeps):
+        records = sweeps[axis]["runs"]
+        for mode in sorted(set([x["mode"] for x in records])):
+            _runs = [x for x in records if x["mode"] == mode]
+            xx = [x[axis] for x in _runs]
+            axes[0, j].loglog(xx, [x["wall_sec"] for x in _runs], "o-",
+                              label="mode %d" %mode)
+            axes[1, j].semilogx(xx, [x["peak_tree_rss_mb"] for x in _runs],
+                                "o-", label="mode %d" %mode)
+        axes[0, j].set_ylabel("wall time (sec)")
+        axes[1, j].set_ylabel("peak RSS (MB)")
+        axes[1, j].set_xlabel(axis)
+        axes[0, j].legend()
+    fig.tight_layout()
+    fig.savefig(out_file)
+
+def main():
+    # parse command line options
+    parser = OptionParser()
+    parser.add_option("--outDir", "-o", dest="out_dir", default=None,
+        help=("Directory for the synthetic data, cellSNP outputs and logs."))
+    parser.add_option("--outJSON", "-j", dest="out_json", default=None,
+        help=("Output json file [default: $outDir/scaling.json]"))
+
+    group1 = OptionGroup(parser, "Sweeps",
+        "Each sweep varies one factor and keeps the others at the base value.")
+    group1.add_option("--cells", dest="cells",
+        default="1000,10000,100000,1000000",
+        help="Comma separated number of cells [default: %default]")
+    group1.add_option("--nprocs", dest="nprocs", default="1,2,4,8,16,32,64",
+        help="Comma separated nproc [default: %default]")
+    group1.add_option("--densities", dest="densities", default="100,1000,10000",
+        help="Comma separated SNPs per Mb [default: %default]")
+    group1.add_option("--baseCELL", type="int", dest="base_cell",
+        default=10000, help="Cells when not swept [default: %default]")
+    group1.add_option("--baseNPROC", type="int", dest="base_nproc", default=1,
+        help="nproc when not swept [default: %default]")
+    group1.add_option("--baseDENSITY", type="float", dest="base_density",
+        default=1000, help="SNPs per Mb when not swept [default: %default]")
+
+    group2 = OptionGroup(parser, "Optional arguments")
+    group2.add_option("--modes", dest="modes", default="1",
+        help="Comma separated cellSNP modes to run [default: %default]")
+    group2.add_option("--depth", type="float", dest="depth", default=20,
+        help="Mean number of reads covering each SNP [default: %default]")
+    group2.add_option("--nCONTIG", type="int", dest="n_contig", default=2,
+        help="Number of contigs [default: %default]")
+    group2.add_option("--contigLEN", type="int", dest="contig_len",
+        default=1000000, help="Length of each contig [default: %default]")
+    group2.add_option("--seed", type="int", dest="seed", default=0,
+        help="Seed for synth_10x.py [default: %default]")
+    group2.add_option("--cellSNP", dest="cellSNP", default="cellSNP",
+        help="The cellSNP command to benchmark [default: %default]")
+    group2.add_option("--extra", dest="extra", default="",
+        help="Extra arguments passed to cellSNP, e.g., \"--maxMEM 32G\"")
+    group2.add_option("--plot", dest="plot", default=None,
+        help="Save the sweeps into this figure, needs matplotlib [optional]")
+
+    parser.add_option_group(group1)
+    parser.add_option_group(group2)
+
+    (options, args) = parser.parse_args()
+    if len(sys.argv[1:]) == 0:
+        print("Welcome to bench_scaling!\n")
+        print("use -h or --help for help on argument.")
+        sys.exit(1)
+
+    if options.out_dir is None:
+        print("Error: need outDir for outputs.")
+        sys.exit(1)
+    data_dir = os.path.join(options.out_dir, "data")
+    run_dir = os.path.join(options.out_dir, "runs")
+    for _dir in [data_dir, run_dir]:
+        if not os.path.exists(_dir):
+            os.makedirs(_dir)
+    out_json = options.out_json
+    if out_json is None:
+        out_json = os.path.join(options.out_dir, "scaling.json")
+
+    modes = [int(x) for x in options.modes.split(",")]
+    n_cpu = os.cpu_count()
+    nprocs = [int(x) for x in options.nprocs.split(",")]
+    if max(nprocs) > n_cpu:
+        print("[bench_scaling] Warning: skip nproc > %d CPUs." %n_cpu)
+        nprocs = [x for x in nprocs if x <= n_cpu]
+
+    ## (cells, nproc, density) of each run, by sweep
+    settings = {
+        "cells": [(int(x), options.base_nproc, options.base_density)
+                  for x in options.cells.split(",")],
+        "nproc": [(options.base_cell, x, options.base_density)
+                  for x in nprocs],
+        "density": [(options.base_cell, options.base_nproc, float(x))
+                    for x in options.densities.split(",")]
+    }
+
+    sweeps = {}
+    for axis in ["cells", "nproc", "density"]:
+        records = []
+        for n_cell, nproc, density in settings[axis]:
+            meta = make_data(data_dir, n_cell, density, options)
+            for mode in modes:
+                out_dir = os.path.join(run_dir, "m%d_c%d_p%d_d%g"
+                                       %(mode, n_cell, nproc, density))
+                if os.path.exists(out_dir):
+                    shutil.rmtree(out_dir)
+                cmd, n_sites, n_reads = mode_command(mode, meta, out_dir,
+                    options.cellSNP, nproc, options.extra.split())
+                RV = run_command(cmd, out_dir + ".log")
+                RV.update({"mode": mode, "cells": n_cell, "nproc": nproc,
+                           "density": density, "sites": n_sites,
+                           "reads": n_reads, "command": " ".join(cmd)})
+                RV["cpu_efficiency"] = (RV["cpu_sec"] /
+                                        max(RV["wall_sec"] * nproc, 1e-9))
+                RV["sites_per_sec"] = n_sites / max(RV["wall_sec"], 1e-9)
+                RV["out_sites"] = count_vcf_sites(
+                    os.path.join(out_dir, "cellSNP.cells.vcf.gz"))
+                if RV["returncode"] != 0:
+                    print("[bench_scaling] Warning: run failed, see %s.log"
+                          %out_dir)
+                records.append(RV)
+
+        ## speedup over the first run of each mode, and the scaling exponent
+        slopes = {}
+        for mode in modes:
+            _runs = [x for x in records if x["mode"] == mode]
+            for x in _runs:
+                x["speedup"] = _runs[0]["wall_sec"] / max(x["wall_sec"], 1e-9)
+            slopes[mode] = {
+                "wall_sec": fit_slope([x[axis] for x in _runs],
+                                      [x["wall_sec"] for x in _runs]),
+                "peak_tree_rss_mb": fit_slope([x[axis] for x in _runs],
+                                      [x["peak_tree_rss_mb"] for x in _runs])}
+        sweeps[axis] = {"runs": records, "exponent": slopes}
+        print_table(records, axis)
+        for mode in modes:
+            print("[bench_scaling] mode %d: wall ~ %s^%s, RSS ~ %s^%s" %(mode,
+                  axis, slopes[mode]["wall_sec"], axis,
+                  slopes[mode]["peak_tree_rss_mb"]))
+
+    bench = {
+        "time": time.strftime("%Y-%m-%d %H:%M:%S"),
+        "host": platform.node(),
+        "platform": platform.platform(),
+        "python": platform.python_version(),
+        "cpu_count": n_cpu,
+        "depth": options.depth,
+        "n_contig": options.n_contig,
+        "contig_len": options.contig_len,
+        "sweeps": sweeps
+    }
+    with open(out_json, "w") as fid:
+        json.dump(bench, fid, indent=2)
+    print("[bench_scaling] results saved in %s" %out_json)
+
+    if options.plot is not None:
+        plot_sweeps(sweeps, options.plot)
+        print("[bench_scaling] figure saved in %s" %options.plot)
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,256 @@
+# generate a synthetic 10x-like BAM, barcode list and SNP panel for testing
+# Date: 17/10/2026
+
+import os
+import sys
+import gzip
+import json
+import pysam
+import numpy as np
+from optparse import OptionParser, OptionGroup
+
+BASES = "ACGT"
+
+def make_reference(rng, n_contig, contig_len):
+    """Random reference sequence for each contig, named 1, 2, ...
+    """
+    return [(str(i + 1), "".join(rng.choice(list(BASES), contig_len)))
+            for i in range(n_contig)]
+
+def make_snps(rng, ref_seqs, density, read_len):
+    """Random bi-allelic SNPs, density per Mb, away from contig ends.
+    """
+    snps = []
+    for chrom, seq in ref_seqs:
+        n_snp = max(1, int(density * len(seq) / 1e6))
+        n_snp = min(n_snp, len(seq) - 4 * read_len)
+        pos = np.sort(rng.choice(np.arange(2 * read_len, len(seq) - 2 * read_len),
+                                 n_snp, replace=False))
+        for p in pos:
+            ref = seq[p]
+            alt = rng.choice([x for x in BASES if x != ref])
+            snps.append((chrom, int(p), ref, alt))   # 0-based pos
+    return snps
+
+def make_haplotypes(rng, ref_seqs, snps, n_donor):
+    """Two haplotypes per donor, with SNP alleles at random frequency.
+    """
+    haps = {}
+    for chrom, seq in ref_seqs:
+        haps[chrom] = [[bytearray(seq, "ascii") for h in range(2)]
+                       for d in range(n_donor)]
+    for chrom, p, ref, alt in snps:
+        af = rng.uniform(0.1, 0.5)
+        for d in range(n_donor):
+            for h in range(2):
+                if rng.rand() < af:
+                    haps[chrom][d][h][p] = ord(alt)
+    return haps
+
+def make_barcodes(rng, n_cell):
+    barcodes = set()
+    while len(barcodes) < n_cell:
+        barcodes.add("".join(rng.choice(list(BASES), 16)) + "-1")
+    return sorted(barcodes)
+
+def make_read(rng, hap, p, read_len, splice_rate, intron_len):
+    """A read covering the 0-based position p, optionally spliced.
+    Return (start, cigar, seq).
+    """
+    offset = rng.randint(read_len)
+    if rng.rand() < splice_rate:
+        k = rng.randint(10, read_len - 10)    # query length of first block
+        if offset < k:
+            start = p - offset
+        else:
+            start = p - offset - intron_len
+        seq = (hap[start : start + k] +
+               hap[start + k + intron_len : start + intron_len + read_len])
+        cigar = [(0, k), (3, intron_len), (0, read_len - k)]
+    else:
+        start = p - offset
+        seq = hap[start : start + read_len]
+        cigar = [(0, read_len)]
+    return start, cigar, seq.decode("ascii")
+
+def main():
+    # parse command line options
+    parser = OptionParser()
+    parser.add_option("--outDir", "-o", dest="out_dir", default=None,
+        help=("Output directory for the bam, barcode and vcf files."))
+    parser.add_option("--seed", type="int", dest="seed", default=0,
+        help=("Seed for the random generator [default: %default]"))
+
+    group1 = OptionGroup(parser, "Data size")
+    group1.add_option("--nCELL", type="int", dest="n_cell", default=400,
+        help="Number of cells [default: %default]")
+    group1.add_option("--nDONOR", type="int", dest="n_donor", default=2,
+        help="Number of donors pooled in the cells [default: %default]")
+    group1.add_option("--nCONTIG", type="int", dest="n_contig", default=2,
+        help="Number of contigs, named 1, 2, ... [default: %default]")
+    group1.add_option("--contigLEN", type="int", dest="contig_len",
+        default=1000000, help="Length of each contig [default: %default]")
+    group1.add_option("--density", type="float", dest="density", default=200,
+        help="Number of SNPs per Mb [default: %default]")
+    group1.add_option("--depth", type="float", dest="depth", default=50,
+        help="Mean number of reads covering each SNP [default: %default]")
+    group1.add_option("--nBULK", type="int", dest="n_bulk", default=2,
+        help="Number of bulk bam files for mode 3 [default: %default]")
+
+    group2 = OptionGroup(parser, "Reads")
+    group2.add_option("--readLEN", type="int", dest="read_len", default=98,
+        help="Read length [default: %default]")
+    group2.add_option("--spliceRATE", type="float", dest="splice_rate",
+        default=0.2, help="Fraction of spliced reads [default: %default]")
+    group2.add_option("--intronLEN", type="int", dest="intron_len",
+        default=500, help="Length of the spliced intron [default: %default]")
+    group2.add_option("--errRATE", type="float", dest="err_rate",
+        default=0.001, help="Sequencing error rate [default: %default]")
+    group2.add_option("--dupRATE", type="float", dest="dup_rate",
+        default=0.3, help="Fraction of reads sharing a UMI [default: %default]")
+    group2.add_option("--lowMAPQ", type="float", dest="low_mapq",
+        default=0.02, help="Fraction of reads with MAPQ 0 [default: %default]")
+    group2.add_option("--noTAG", type="float", dest="no_tag",
+        default=0.01, help="Fraction of reads without CB or UR tag "
+        "[default: %default]")
+
+    parser.add_option_group(group1)
+    parser.add_option_group(group2)
+
+    (options, args) = parser.parse_args()
+    if len(sys.argv[1:]) == 0:
+        print("Welcome to synth_10x!\n")
+        print("use -h or --help for help on argument.")
+        sys.exit(1)
+
+    if options.out_dir is None:
+        print("Error: need outDir for output files.")
+        sys.exit(1)
+    out_dir = options.out_dir
+    if not os.path.exists(out_dir):
+        os.makedirs(out_dir)
+    if options.contig_len < 4 * (options.read_len + options.intron_len):
+        print("Error: contigLEN is too short for readLEN and intronLEN.")
+        sys.exit(1)
+
+    rng = np.random.RandomState(options.seed)
+    read_len = options.read_len
+    ref_seqs = make_reference(rng, options.n_contig, options.contig_len)
+    snps = make_snps(rng, ref_seqs, options.density,
+                     read_len + options.intron_len)
+    haps = make_haplotypes(rng, ref_seqs, snps, options.n_donor)
+    barcodes = make_barcodes(rng, options.n_cell)
+    cell_donor = rng.randint(options.n_donor, size=options.n_cell)
+
+    ## reference, panel and barcodes
+    with open(os.path.join(out_dir, "ref.fa"), "w") as fid:
+        for chrom, seq in ref_seqs:
+            fid.writelines(">%s\n" %chrom)
+            for i in range(0, len(seq), 60):
+                fid.writelines(seq[i : i + 60] + "\n")
+    pysam.faidx(os.path.join(out_dir, "ref.fa"))
+
+    with gzip.open(os.path.join(out_dir, "regions.vcf.gz"), "wt") as fid:
+        fid.writelines("##fileformat=VCFv4.2\n")
+        for chrom, seq in ref_seqs:
+            fid.writelines("##contig=<ID=%s,length=%d>\n" %(chrom, len(seq)))
+        fid.writelines("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n")
+        for chrom, p, ref, alt in snps:
+            fid.writelines("%s\t%d\t.\t%s\t%s\t.\tPASS\t.\n"
+                           %(chrom, p + 1, ref, alt))
+
+    with open(os.path.join(out_dir, "barcodes.tsv"), "w") as fid:
+        fid.writelines("\n".join(barcodes) + "\n")
+
+    ## reads
+    header = {"HD": {"VN": "1.6", "SO": "unsorted"},
+              "SQ": [{"SN": chrom, "LN": len(seq)} for chrom, seq in ref_seqs]}
+    tid = dict([(ref_seqs[i][0], i) for i in range(len(ref_seqs))])
+    sc_file = os.path.join(out_dir, "synth.unsorted.bam")
+    bulk_files = [os.path.join(out_dir, "bulk_%d.unsorted.bam" %i)
+                  for i in range(options.n_bulk)]
+    fid_sc = pysam.AlignmentFile(sc_file, "wb", header=header)
+    fid_bulk = [pysam.AlignmentFile(x, "wb", header=header) for x in bulk_files]
+
+    n_reads, n_bulk_reads = 0, 0
+    umi_pool = []
+    for chrom, p, ref, alt in snps:
+        for r in range(rng.poisson(options.depth)):
+            # duplicated reads share the cell and UMI of a recent read
+            if len(umi_pool) > 0 and rng.rand() < options.dup_rate:
+                cell, umi = umi_pool[rng.randint(len(umi_pool))]
+            else:
+                cell = rng.randint(options.n_cell)
+                umi = "".join(rng.choice(list(BASES), 10))
+                umi_pool.append((cell, umi))
+                if len(umi_pool) > 1000:
+                    umi_pool.pop(0)
+            hap = haps[chrom][cell_donor[cell]][rng.randint(2)]
+            start, cigar, seq = make_read(rng, hap, p, read_len,
+                options.splice_rate, options.intron_len)
+            if options.err_rate > 0:
+                seq = list(seq)
+                for i in np.where(rng.rand(read_len) < options.err_rate)[0]:
+                    seq[i] = rng.choice(list(BASES))
+                seq = "".join(seq)
+
+            read = pysam.AlignedSegment()
+            read.query_name = "read%d" %n_reads
+            read.reference_id = tid[chrom]
+            read.reference_start = start
+            read.cigartuples = cigar
+            read.query_sequence = seq
+            read.query_qualities = pysam.qualitystring_to_array(
+                "".join([chr(33 + x) for x in rng.randint(20, 41, read_len)]))
+            read.flag = 16 if rng.rand() < 0.5 else 0
+            read.mapping_quality = 0 if rng.rand() < options.low_mapq else 255
+            tags = [("CB", barcodes[cell]), ("UR", umi)]
+            if rng.rand() < options.no_tag:
+                tags.pop(rng.randint(2))
+            read.set_tags(tags)
+            fid_sc.write(read)
+            n_reads += 1
+            if options.n_bulk > 0:
+                fid_bulk[cell % options.n_bulk].write(read)
+                n_bulk_reads += 1
+    fid_sc.close()
+    for fid in fid_bulk:
+        fid.close()
+
+    ## sort and index
+    sam_files = []
+    for _file in [sc_file] + bulk_files:
+        sorted_file = _file.replace(".unsorted.bam", ".bam")
+        pysam.sort("-o", sorted_file, _file)
+        pysam.index(sorted_file)
+        os.remove(_file)
+        sam_files.append(sorted_file)
+
+    meta = {
+        "seed": options.seed,
+        "n_cell": options.n_cell,
+        "n_donor": options.n_donor,
+        "n_contig": options.n_contig,
+        "contig_len": options.contig_len,
+        "contigs": [x[0] for x in ref_seqs],
+        "density": options.density,
+        "depth": options.depth,
+        "read_len": read_len,
+        "splice_rate": options.splice_rate,
+        "n_snp": len(snps),
+        "n_reads": n_reads,
+        "n_bulk_reads": n_bulk_reads,
+        "sam_file": sam_files[0],
+        "bulk_files": sam_files[1:],
+        "barcode_file": os.path.join(out_dir, "barcodes.tsv"),
+        "region_file": os.path.join(out_dir, "regions.vcf.gz"),
+        "ref_file": os.path.join(out_dir, "ref.fa")
+    }
+    with open(os.path.join(out_dir, "synth.json"), "w") as fid:
+        json.dump(meta, fid, indent=2)
+    print("[synth_10x] %d SNPs, %d reads in %d cells written to %s"
+          %(len(snps), n_reads, options.n_cell, out_dir))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,31 @@
+# compare GT and PL of the SIMD kernel (gl_kernel.h) with qual_matrix_to_geno,
+# per site and for many sites in one call
+# Date: 17/10/2026
+
+import sys
+from optparse import OptionParser
+from cellSNP.utils.bench_utils import compare_geno_batch
+
+def main():
+    # parse command line options
+    parser = OptionParser()
+    parser.add_option("--nCELL", "-n", type="int", dest="n_cells",
+        default=10000, help=("Number of cells per REF and ALT pair "
+                             "[default: %default]"))
+    parser.add_option("--seed", type="int", dest="seed", default=0,
+        help=("Seed for the random inputs [default: %default]"))
+
+    (options, args) = parser.parse_args()
+    mismatches = compare_geno_batch(options.n_cells, options.seed)
+    for REF, ALT, doublet_GL, i, expect, got in mismatches[:20]:
+        print("REF=%s ALT=%s doublet_GL=%s cell %d: GT:PL %s, kernel %s" %(
+              REF, ALT, doublet_GL, i, ":".join(expect), ":".join(got)))
+    if len(mismatches) > 0:
+        print("Error: %d mismatches of geno_batch or geno_sites." 
+              %len(mismatches))
+        sys.exit(1)
+    print("geno_batch and geno_sites match qual_matrix_to_geno.")
+
+
+if __name__ == "__main__":
+    main()
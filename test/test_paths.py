@@ -0,0 +1,207 @@
+# check that the reading paths of cellSNP give the same vcf lines on data from
+# synth_10x.py: indexed file vs stdin, fetch vs sweep engine, whole chroms
+# vs regionsBED, and one sam file vs the same reads in two files
+# Date: 17/10/2026
+
+import os
+import sys
+import json
+import gzip
+import zlib
+import bisect
+import shutil
+import subprocess
+import pysam
+from optparse import OptionParser, OptionGroup
+
+TEST_DIR = os.path.dirname(os.path.abspath(__file__))
+
+def make_data(data_dir, seed):
+    """Generate a small synthetic data set, reused if it exists.
+    """
+    meta_file = os.path.join(data_dir, "synth.json")
+    if not os.path.isfile(meta_file):
+        cmd = [sys.executable, os.path.join(TEST_DIR, "synth_10x.py"),
+               "-o", data_dir, "--seed", str(seed), "--nCELL", "200",
+               "--nCONTIG", "2", "--contigLEN", "200000", "--density", "500",
+               "--depth", "40", "--nBULK", "0"]
+        subprocess.check_call(cmd)
+    with open(meta_file, "r") as fid:
+        return json.load(fid)
+
+def split_bam(sam_file, out_prefix, n_files=2):
+    """Deal the reads of a sorted sam file into n_files indexed bam files by
+    their cell and UMI, so the reads of a UMI are in one file, in the same
+    order, and the first of them is kept by UMI counting as in one file.
+    """
+    out_files = ["%s_%d.bam" %(out_prefix, i) for i in range(n_files)]
+    with pysam.AlignmentFile(sam_file, "rb") as fid:
+        fids = [pysam.AlignmentFile(x, "wb", template=fid) for x in out_files]
+        for read in fid.fetch(until_eof=True):
+            _key = "%s>%s" %(read.get_tag("CB") if read.has_tag("CB") else "",
+                             read.get_tag("UR") if read.has_tag("UR") else "")
+            fids[zlib.crc32(_key.encode()) % n_files].write(read)
+        for _fid in fids:
+            _fid.close()
+    for _file in out_files:
+        pysam.index(_file)
+    return out_files
+
+def make_bed(region_file, bed_file, flank=300):
+    """Regions around every other SNP of the panel, as a BED file; return
+    the sorted and merged (start, end) of each chrom, 0-based.
+    """
+    regions = {}
+    with gzip.open(region_file, "rt") as fid:
+        k = 0
+        for line in fid:
+            if line.startswith("#"):
+                continue
+            k += 1
+            if k % 2 == 0:
+                continue
+            chrom, pos = line.split("\t")[:2]
+            start = max(0, int(pos) - 1 - flank)
+            regions.setdefault(chrom, []).append((start, int(pos) + flank))
+    with open(bed_file, "w") as fid:
+        for chrom in regions:
+            for start, end in regions[chrom]:
+                fid.writelines("%s\t%d\t%d\n" %(chrom, start, end))
+    for chrom in regions:
+        _merged = []
+        for start, end in sorted(regions[chrom]):
+            if len(_merged) > 0 and start <= _merged[-1][1]:
+                _merged[-1] = (_merged[-1][0], max(_merged[-1][1], end))
+            else:
+                _merged.append((start, end))
+        regions[chrom] = _merged
+    return regions
+
+def in_regions(regions, chrom, pos):
+    """If the 1-based pos is in the merged (start, end) regions of chrom.
+    """
+    _starts = [x[0] for x in regions.get(chrom, [])]
+    i = bisect.bisect_right(_starts, pos - 1) - 1
+    return i >= 0 and pos - 1 < regions[chrom][i][1]
+
+def run_cellSNP(cmd, out_dir, stdin_file=None):
+    """Run cellSNP into out_dir, return the vcf lines without the header.
+    """
+    if os.path.exists(out_dir):
+        shutil.rmtree(out_dir)
+    os.makedirs(out_dir)
+    cmd = cmd + ["-O", out_dir]
+    with open(out_dir + ".log", "w") as fid:
+        if stdin_file is None:
+            ret = subprocess.call(cmd, stdout=fid, stderr=subprocess.STDOUT)
+        else:
+            with open(stdin_file, "rb") as fin:
+                ret = subprocess.call(cmd, stdin=fin, stdout=fid,
+                                      stderr=subprocess.STDOUT)
+    if ret != 0:
+        print("Error: failed %s, see %s.log" %(" ".join(cmd), out_dir))
+        sys.exit(1)
+    vcf_file = os.path.join(out_dir, "cellSNP.cells.vcf.gz")
+    with gzip.open(vcf_file, "rb") as fid:
+        return [x for x in fid if not x.startswith(b"#")]
+
+def compare_lines(name, lines1, lines2):
+    """Print the first difference of two vcf bodies; return True if equal.
+    """
+    if lines1 == lines2:
+        print("[test_paths] %s: %d lines, same" %(name, len(lines1)))
+        return True
+    print("[test_paths] %s: %d vs %d lines, different"
+          %(name, len(lines1), len(lines2)))
+    for i in range(min(len(lines1), len(lines2))):
+        if lines1[i] != lines2[i]:
+            print("  line %d:\n    %s\n    %s" %(i + 1, lines1[i][:200],
+                                                lines2[i][:200]))
+            break
+    return False
+
+def main():
+    # parse command line options
+    parser = OptionParser()
+    parser.add_option("--dataDir", "-i", dest="data_dir", default=None,
+        help=("Directory generated by synth_10x.py [default: $outDir/data, "
+              "generated if not existing]"))
+    parser.add_option("--outDir", "-o", dest="out_dir", default=None,
+        help=("Directory for the cellSNP outputs and logs."))
+
+    group1 = OptionGroup(parser, "Optional arguments")
+    group1.add_option("--nproc", "-p", type="int", dest="nproc", default=2,
+        help="Number of subprocesses for cellSNP [default: %default]")
+    group1.add_option("--seed", type="int", dest="seed", default=0,
+        help="Seed for synth_10x.py [default: %default]")
+    group1.add_option("--cellSNP", dest="cellSNP", default="cellSNP",
+        help="The cellSNP command to test [default: %default]")
+    parser.add_option_group(group1)
+
+    (options, args) = parser.parse_args()
+    if len(sys.argv[1:]) == 0:
+        print("Welcome to test_paths!\n")
+        print("use -h or --help for help on argument.")
+        sys.exit(1)
+
+    if options.out_dir is None:
+        print("Error: need outDir for outputs.")
+        sys.exit(1)
+    out_dir = options.out_dir
+    if not os.path.exists(out_dir):
+        os.makedirs(out_dir)
+    data_dir = options.data_dir
+    if data_dir is None:
+        data_dir = os.path.join(out_dir, "data")
+    meta = make_data(data_dir, options.seed)
+
+    sam_file = meta["sam_file"]
+    part_files = split_bam(sam_file, os.path.join(out_dir, "part"))
+    bed_file = os.path.join(out_dir, "regions.bed")
+    regions = make_bed(meta["region_file"], bed_file)
+    cmd = [options.cellSNP, "-p", str(options.nproc),
+           "-b", meta["barcode_file"]]
+    mode1 = ["-R", meta["region_file"]]
+    mode2 = ["--chrom", ",".join(meta["contigs"])]
+    _out = lambda x: os.path.join(out_dir, x)
+
+    is_same = []
+    ## mode 1: indexed file, stdin, fetch and sweep engine, two files
+    lines_fetch = run_cellSNP(cmd + ["-s", sam_file, "--engine", "fetch"] +
+                              mode1, _out("mode1_fetch"))
+    lines_sweep = run_cellSNP(cmd + ["-s", sam_file, "--engine", "sweep"] +
+                              mode1, _out("mode1_sweep"))
+    is_same.append(compare_lines("mode 1 fetch vs sweep engine",
+                                 lines_fetch, lines_sweep))
+    lines_stdin = run_cellSNP(cmd + ["-s", "-"] + mode1, _out("mode1_stdin"),
+                              stdin_file=sam_file)
+    is_same.append(compare_lines("mode 1 indexed vs stdin",
+                                 lines_fetch, lines_stdin))
+    lines_pool = run_cellSNP(cmd + ["-s", ",".join(part_files)] + mode1,
+                             _out("mode1_pool"))
+    is_same.append(compare_lines("mode 1 one file vs two files",
+                                 lines_fetch, lines_pool))
+
+    ## mode 2: whole chroms in the BED regions vs the regions, two files
+    lines_chrom = run_cellSNP(cmd + ["-s", sam_file] + mode2,
+                              _out("mode2_chrom"))
+    lines_bed = run_cellSNP(cmd + ["-s", sam_file, "--regionsBED", bed_file] +
+                            mode2, _out("mode2_bed"))
+    lines_in_bed = [x for x in lines_chrom if in_regions(regions,
+        x.split(b"\t")[0].decode(), int(x.split(b"\t")[1]))]
+    is_same.append(compare_lines("mode 2 whole chroms in BED vs regionsBED",
+                                 lines_in_bed, lines_bed))
+    lines_pool = run_cellSNP(cmd + ["-s", ",".join(part_files)] + mode2,
+                             _out("mode2_pool"))
+    is_same.append(compare_lines("mode 2 one file vs two files",
+                                 lines_chrom, lines_pool))
+
+    if not all(is_same):
+        print("Error: %d of %d paths differ." %(len(is_same) - sum(is_same),
+                                                len(is_same)))
+        sys.exit(1)
+    print("[test_paths] all %d paths give the same vcf lines." %len(is_same))
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,33 @@
+# compare the vcf lines of the native formatter (vcf_format.h) with the str
+# formatter with qual_matrix_to_geno, byte for byte
+# Date: 17/10/2026
+
+import sys
+from optparse import OptionParser
+from cellSNP.utils.bench_utils import compare_vcf_line
+
+def main():
+    # parse command line options
+    parser = OptionParser()
+    parser.add_option("--nSITE", "-s", type="int", dest="n_sites",
+        default=300, help=("Number of sites [default: %default]"))
+    parser.add_option("--nCELL", "-n", type="int", dest="n_cells",
+        default=200, help=("Number of cells per site [default: %default]"))
+    parser.add_option("--seed", type="int", dest="seed", default=0,
+        help=("Seed for the random inputs [default: %default]"))
+
+    (options, args) = parser.parse_args()
+    mismatches = compare_vcf_line(options.n_sites, options.n_cells, 
+                                  options.seed)
+    for k, mode, expect, got in mismatches[:5]:
+        print("site %d %s:\n  str    %s\n  native %s" %(k, mode, 
+              None if expect is None else expect[:200], 
+              None if got is None else got[:200]))
+    if len(mismatches) > 0:
+        print("Error: %d mismatches of get_vcf_line." %len(mismatches))
+        sys.exit(1)
+    print("get_vcf_line matches the str formatter.")
+
+
+if __name__ == "__main__":
+    main()